@@ -1,82 +1,594 @@
 #include <p89v51rd2.h>
 
 #include "avr.h"
+#include "profile.h"
+#include "timer.h"
+#include "trace.h"
 
-/* pretty accurate delay in milliseconds up to 16 seconds */
-static void delay_ms(unsigned short ms)
+/* serial programming parameters from the datasheets, with write delays rounded
+ * up to 100 us; the first entry stands in for unrecognized parts, so that they
+ * are still written correctly, if slowly, with small pages and byte writes */
+static const struct avr_device devices[] = {
+	/* signature,        flash, page, eeprom, page, t_wd: flash, eeprom, erase */
+	{{0x00, 0x00, 0x00}, 0x0800, 0x20, 0x0080, 1, 45, 90, 105},
+	{{0x1e, 0x90, 0x07}, 0x0400, 0x20, 0x0040, 4, 45, 40, 90},  /* ATtiny13 */
+	{{0x1e, 0x91, 0x08}, 0x0800, 0x20, 0x0080, 4, 45, 40, 90},  /* ATtiny25 */
+	{{0x1e, 0x92, 0x06}, 0x1000, 0x40, 0x0100, 4, 45, 40, 90},  /* ATtiny45 */
+	{{0x1e, 0x93, 0x0b}, 0x2000, 0x40, 0x0200, 4, 45, 40, 90},  /* ATtiny85 */
+	{{0x1e, 0x91, 0x0b}, 0x0800, 0x20, 0x0080, 4, 45, 40, 90},  /* ATtiny24 */
+	{{0x1e, 0x92, 0x07}, 0x1000, 0x40, 0x0100, 4, 45, 40, 90},  /* ATtiny44 */
+	{{0x1e, 0x93, 0x0c}, 0x2000, 0x40, 0x0200, 4, 45, 40, 90},  /* ATtiny84 */
+	{{0x1e, 0x91, 0x0a}, 0x0800, 0x20, 0x0080, 4, 45, 40, 90},  /* ATtiny2313 */
+	{{0x1e, 0x93, 0x07}, 0x2000, 0x40, 0x0200, 1, 45, 90, 90},  /* ATmega8 */
+	{{0x1e, 0x94, 0x03}, 0x4000, 0x80, 0x0200, 4, 45, 90, 90},  /* ATmega16 */
+	{{0x1e, 0x95, 0x02}, 0x8000, 0x80, 0x0400, 4, 45, 90, 90},  /* ATmega32 */
+	{{0x1e, 0x92, 0x05}, 0x1000, 0x40, 0x0100, 4, 45, 36, 90},  /* ATmega48 */
+	{{0x1e, 0x93, 0x0a}, 0x2000, 0x40, 0x0200, 4, 45, 36, 90},  /* ATmega88 */
+	{{0x1e, 0x94, 0x06}, 0x4000, 0x80, 0x0200, 4, 45, 36, 90},  /* ATmega168 */
+	{{0x1e, 0x92, 0x0a}, 0x1000, 0x40, 0x0100, 4, 45, 36, 90},  /* ATmega48P */
+	{{0x1e, 0x93, 0x0f}, 0x2000, 0x40, 0x0200, 4, 45, 36, 90},  /* ATmega88P */
+	{{0x1e, 0x94, 0x0b}, 0x4000, 0x80, 0x0200, 4, 45, 36, 90},  /* ATmega168P */
+	{{0x1e, 0x95, 0x14}, 0x8000, 0x80, 0x0400, 4, 45, 36, 90},  /* ATmega328 */
+	{{0x1e, 0x95, 0x0f}, 0x8000, 0x80, 0x0400, 4, 45, 36, 90},  /* ATmega328P */
+};
+
+/* the parameters of the part in serial programming mode */
+const struct avr_device *avr_device = devices;
+
+/* SCK rates, fastest first: the target must see SCK high and low for more than
+ * two of its own clock cycles each, so the fastest rate that still gets a
+ * reliable response depends on how the target is clocked */
+#ifndef SPI_SW
+static const unsigned char sck_spcr[] = {
+	SPE | MSTR,  /* f(OSC) / 4 */
+	SPE | MSTR | SPR0,  /* f(OSC) / 16 */
+	SPE | MSTR | SPR1,  /* f(OSC) / 64 */
+	SPE | MSTR | SPR1 | SPR0,  /* f(OSC) / 128 */
+};
+#define SCK_RATES (sizeof sck_spcr)
+#else
+static const unsigned char sck_delays[] = {0, 4, 16, 64};  /* per half bit */
+#define SCK_RATES (sizeof sck_delays)
+static unsigned char sck_delay;
+#endif
+static unsigned char sck;  /* index of the rate picked for the target */
+
+#ifndef GANG
+#define RESET(level) (AVR_RESET = (level))
+#define VERIFY(value)
+#else
+static unsigned char gang = (1 << GANG) - 1;  /* targets still in the gang */
+static unsigned char gang_first;  /* the lowest-numbered of them */
+static unsigned char gang_rx[GANG];  /* the last byte each of them sent */
+static char gang_reason[GANG];  /* why the others were dropped */
+static void gang_drop(unsigned char, char);
+
+/* the resets of the targets in the gang are driven together, and the rest are
+ * left running; the MISO bits are always written high, as inputs */
+#define RESET(level) (P2 = (level) ? 0xff : ~(gang << 4))
+#define VERIFY(value) gang_drop(gang_differ((value), 0xff), AVR_GANG_VERIFY)
+
+/* sort the levels of the MISO lines sampled on each clock of a byte into the
+ * byte each target sent */
+static void gang_sample(const unsigned char *samples)
 {
-	ms = (ms << 2) + 1;  /* 1000us / 250us */
-	TL0 = TH0;
-	TR0 = 1;
-	do {
-		while (!TF0);
-		TF0 = 0;
-	} while (--ms);
-	TR0 = 0;
+	unsigned char t, j, mask, in;
+	for (t = 0, mask = 1; t < GANG; ++t, mask <<= 1) {
+		if (!(gang & mask))
+			continue;
+		for (in = 0, j = 0; j < 8; ++j)
+			in = in << 1 | !!(samples[j] & mask);
+		gang_rx[t] = in;
+	}
 }
 
-/* send a reset pulse to the AVR */
-static __bit prog_en;
-void avr_reset(void)
+/* return the targets in the gang whose last byte differs from a value in any
+ * of the given bits */
+static unsigned char gang_differ(unsigned char value, unsigned char bits)
 {
-	AVR_RESET = 0;
-	delay_ms(1);
-	AVR_RESET = 1;
-	prog_en = 0;
+	unsigned char t, mask = 0;
+	for (t = 0; t < GANG; ++t)
+		if ((gang_rx[t] ^ value) & bits)
+			mask |= 1 << t;
+	return mask & gang;
+}
+#endif
+
+static void sck_set(unsigned char rate)
+{
+	sck = rate;
+#ifndef SPI_SW
+	SPCR = sck_spcr[rate];
+#else
+	sck_delay = sck_delays[rate];
+#endif
+}
+
+/* profiling builds run under a simulator with no SPI peripheral, and nothing on
+ * the other end of the pins: leave the shift time out, and carry on as if the
+ * AVR had answered */
+#ifndef PROFILE
+#define SPI_WAIT() while (!(SPSR & SPIF))
+#define IN_SYNC(rx, tx) ((rx)[2] == (tx)[1] && is_in_sync())
+#else
+#define SPI_WAIT()
+#define IN_SYNC(rx, tx) (is_in_sync() || 1)
+#endif
+
+/* exchange a single byte on the SPI */
+static unsigned char spi_xfer(unsigned char out)
+{
+#ifndef SPI_SW
+	PROFILE_VAR(t);
+	PROFILE_START(t);
+	SPSR &= ~SPIF;
+	SPDAT = out;
+	SPI_WAIT();
+	PROFILE_STOP(PROFILE_SPI_XFER, t);
+	return SPDAT;
+#else
+	unsigned char in = 0, j, d;
+#ifdef GANG
+	unsigned char samples[8];
+#endif
+	PROFILE_VAR(t);
+	PROFILE_START(t);
+	for (j = 0; j < 8; ++j) {
+		out = out >> 7 | out << 1;
+		P1_5 = out & 1;
+		P1_7 = 1;
+		for (d = sck_delay; d; --d);
+#ifndef GANG
+		in = in << 1 | P1_6;
+#else
+		samples[j] = P2;
+#endif
+		P1_7 = 0;
+		for (d = sck_delay; d; --d);
+	}
+#ifdef GANG
+	gang_sample(samples);
+	in = gang_rx[gang_first];
+#endif
+	PROFILE_STOP(PROFILE_SPI_XFER, t);
+	return in;
+#endif
+}
+
+/* transmit a single byte on the SPI, ignoring whatever comes back */
+static void spi_tx(unsigned char out)
+{
+	PROFILE_VAR(t);
+	PROFILE_START(t);
+#ifndef SPI_SW
+	SPSR &= ~SPIF;
+	SPDAT = out;
+	SPI_WAIT();
+#else
+	if (sck_delay) {  /* slowed down for the target; no hurry */
+		spi_xfer(out);
+		return;
+	}
+	/* unrolled, and without sampling MISO, this is about twice as fast as
+	 * spi_xfer() */
+	P1_5 = out & 0x80;
+	P1_7 = 1;
+	P1_7 = 0;
+	P1_5 = out & 0x40;
+	P1_7 = 1;
+	P1_7 = 0;
+	P1_5 = out & 0x20;
+	P1_7 = 1;
+	P1_7 = 0;
+	P1_5 = out & 0x10;
+	P1_7 = 1;
+	P1_7 = 0;
+	P1_5 = out & 0x08;
+	P1_7 = 1;
+	P1_7 = 0;
+	P1_5 = out & 0x04;
+	P1_7 = 1;
+	P1_7 = 0;
+	P1_5 = out & 0x02;
+	P1_7 = 1;
+	P1_7 = 0;
+	P1_5 = out & 0x01;
+	P1_7 = 1;
+	P1_7 = 0;
+#endif
+	PROFILE_STOP(PROFILE_SPI_TX, t);
 }
 
 /* transmit/receive on the SPI */
-#define spi_xcv(tx, rx) avr_spi(tx, rx, sizeof tx)
-void avr_spi(const char *tx, char *rx, unsigned char len)
+#define spi_xcv(tx, rx) spi(tx, rx, sizeof tx)
+struct avr_stats avr_stats;
+static void spi(const char *tx, char *rx, unsigned char len)
 {
 	unsigned char i;
-	for (i = 0; i < len; ++i) {
-#ifndef SPI_SW
-		SPSR &= ~SPIF;
-		SPDAT = tx[i];
-		while (!(SPSR & SPIF));
-		rx[i] = SPDAT;
+#ifdef TRACE
+	unsigned char event[5];
+	for (i = 0; i < 4; ++i)
+		event[i] = i < len ? tx[i] : 0;
+#endif
+	for (i = 0; i < len; ++i)
+		rx[i] = spi_xfer(tx[i]);
+	++avr_stats.instructions;
+#ifdef TRACE
+	event[4] = len ? rx[len - 1] : 0;
+	trace(TRACE_SPI, event);
+#endif
+}
+
+/* poll the !RDY/BSY flag and non-zero if ready, or zero if not */
+static __bit is_rdy(void)
+{
+	static const unsigned char tx[] = {0xf0, 0, 0, 0};
+	unsigned char rx[sizeof tx];
+	spi_xcv(tx, rx);
+#ifndef GANG
+	return !(rx[3] & 1);
 #else
-		unsigned char out = tx[i], in = 0, j;
-		for (j = 0; j < 8; ++j) {
-			out = out >> 7 | out << 1;
-			P1_5 = out & 1;
-			P1_7 = 1;
-			in = in << 1 | P1_6;
-			P1_7 = 0;
-		}
-		rx[i] = in;
+	return !gang_differ(0, 1);
+#endif
+}
+
+static unsigned char flash_read(unsigned short addr)
+{
+	unsigned char buf[4] = {
+		addr % 2 ? 0x28 : 0x20,
+		addr / 2 / 0x100,
+		addr / 2 & 0xff,
+	};
+	spi_xcv(buf, buf);
+	return buf[3];
+}
+
+static unsigned char eeprom_read(unsigned short addr)
+{
+	unsigned char buf[4] = {0xa0, addr >> 8, addr & 0xff};
+	spi_xcv(buf, buf);
+	return buf[3];
+}
+
+/* write cycles (page writes, EEPROM writes and chip erases) are started
+ * without waiting for them to finish; every other operation waits first, and
+ * avr_busy() lets the caller do something useful in the meantime
+ *
+ * how the end of a write cycle is detected is up to avr_set_wait():
+ *  AVR_WAIT_RDY   poll the !RDY/BSY flag
+ *  AVR_WAIT_DATA  read back a written location until it reads as written;
+ *                 a location being written reads 0xff, so this falls back to
+ *                 AVR_WAIT_TIME if all that was written was 0xff, as for a
+ *                 chip erase
+ *  AVR_WAIT_TIME  wait out the part's t(WD) for the operation */
+static __bit busy;
+static unsigned char wait_mode, busy_op, busy_mode;
+static unsigned short busy_cycles, busy_polls;
+static unsigned long busy_start;
+static unsigned short poll_addr, busy_addr;  /* the location to read back */
+static unsigned char poll_value = 0xff, busy_value;  /* and its new value */
+struct avr_wait_stats avr_wait_stats[3];
+
+/* start timing a write cycle that was just started, by timer_cycles() rather
+ * than timer_ticks(), which would lose the ticks that pass during the SPI
+ * transfers in between polls, on the slowest cycles most of all */
+static void start(unsigned char op, unsigned char t_wd)
+{
+	busy = 1;
+	busy_op = op;
+	busy_mode = wait_mode;
+	busy_addr = poll_addr;
+	busy_value = poll_value;
+	poll_value = 0xff;
+	if (busy_mode == AVR_WAIT_DATA && busy_value == 0xff)
+		busy_mode = AVR_WAIT_TIME;
+	busy_cycles = t_wd * TIMER_TICK_CYCLES;
+	busy_polls = 0;
+	busy_start = timer_cycles();
+}
+
+/* return the machine cycles since the write cycle in progress started */
+static unsigned long elapsed(void)
+{
+	return timer_cycles() - busy_start;
+}
+
+#ifdef GANG
+/* return non-zero if none of the targets are still busy, or if those that are
+ * have been for so much longer than t(WD) that they have been dropped */
+static __bit gang_settled(unsigned char late)
+{
+	if (!late)
+		return 1;
+	if (elapsed() < 4ul * busy_cycles)
+		return 0;
+	gang_drop(late, AVR_GANG_BUSY);
+	return 1;
+}
+#endif
+
+/* return non-zero if the write cycle in progress has finished */
+static __bit is_done(void)
+{
+	switch (busy_mode) {
+	case AVR_WAIT_RDY:
+		++busy_polls;
+#ifndef GANG
+		return is_rdy();
+#else
+		is_rdy();
+		return gang_settled(gang_differ(0, 1));
+#endif
+	case AVR_WAIT_DATA:
+		++busy_polls;
+#ifndef GANG
+		return (busy_op == AVR_OP_FLASH ? flash_read(busy_addr)
+				: eeprom_read(busy_addr)) == busy_value;
+#else
+		if (busy_op == AVR_OP_FLASH)
+			flash_read(busy_addr);
+		else
+			eeprom_read(busy_addr);
+		return gang_settled(gang_differ(busy_value, 0xff));
+#endif
+	}
+	return elapsed() >= busy_cycles;
+}
+
+/* return non-zero while a write cycle is still in progress */
+__bit avr_busy(void)
+{
+	if (busy && is_done()) {
+		struct avr_wait_stats *stats = avr_wait_stats + busy_op;
+		unsigned short ticks = elapsed() / TIMER_TICK_CYCLES;
+		++stats->count;
+		stats->polls += busy_polls;
+		stats->ticks += ticks;
+		if (stats->max < ticks)
+			stats->max = ticks;
+		++avr_stats.writes;
+		avr_stats.polls += busy_polls;
+		busy = 0;
+	}
+	return busy;
+}
+
+/* block until any write cycle in progress has finished */
+static void wait(void)
+{
+	while (avr_busy());
+}
+
+/* choose how the end of a write cycle is detected, and clear the statistics */
+void avr_set_wait(unsigned char mode)
+{
+	unsigned char i;
+	wait();
+	wait_mode = mode;
+	for (i = 0; i < 3; ++i) {
+		avr_wait_stats[i].count = 0;
+		avr_wait_stats[i].polls = 0;
+		avr_wait_stats[i].ticks = 0;
+		avr_wait_stats[i].max = 0;
+	}
+}
+
+unsigned char avr_get_wait(void)
+{
+	return wait_mode;
+}
+
+/* program memory is cached a line at a time, each filled by streaming the read
+ * instructions back to back; a line only ever holds what was read from the
+ * AVR, so a page write drops the lines it covers rather than guessing what
+ * they now hold (which would also have a read-after-write check read back the
+ * cache), and a chip erase, a reset, or an arbitrary instruction drops them
+ * all; lines not being written can be read while a write cycle is going on */
+#if AVR_CACHE_LINES
+#if AVR_CACHE_LINE & (AVR_CACHE_LINE - 1) || AVR_CACHE_LINES > 8
+#error AVR_CACHE_LINE must be a power of two, and AVR_CACHE_LINES at most 8
+#endif
+static __xdata unsigned char cache[AVR_CACHE_LINES][AVR_CACHE_LINE];
+static unsigned short cache_addr[AVR_CACHE_LINES];
+static unsigned char cache_valid;  /* a bit for each line that holds one */
+static unsigned char cache_next;  /* the line to fill next, round robin */
+
+/* drop the lines overlapping count bytes from addr, or all of them if count
+ * is 0 */
+static void cache_drop(unsigned short addr, unsigned short count)
+{
+	unsigned char i;
+	for (i = 0; i < AVR_CACHE_LINES; ++i)
+		if (!count || (unsigned short)(cache_addr[i] - addr) < count
+				|| (unsigned short)(addr - cache_addr[i])
+				< AVR_CACHE_LINE)
+			cache_valid &= ~(1 << i);
+}
+
+/* read a line of program memory into the cache, returning its index */
+static unsigned char fill(unsigned short addr)
+{
+	unsigned char i, line = cache_next, op = 0x20;
+	unsigned char hi = addr >> 9, lo = addr >> 1;
+	__xdata unsigned char *data = cache[line];
+#ifdef TRACE
+	unsigned char event[5] = {addr >> 8, addr & 0xff, AVR_CACHE_LINE};
+	trace(TRACE_FILL, event);
 #endif
+	cache_next = (line + 1) % AVR_CACHE_LINES;
+	wait();
+	avr_stats.instructions += AVR_CACHE_LINE;
+	++avr_stats.cache_misses;
+	for (i = 0; i < AVR_CACHE_LINE; ++i) {
+		spi_tx(op);
+		spi_tx(hi);
+		spi_tx(lo);
+		data[i] = spi_xfer(0);
+		VERIFY(data[i]);
+		op ^= 0x28 ^ 0x20;  /* alternate between the low and high bytes */
+		if (op == 0x20 && !++lo)
+			++hi;
 	}
+	cache_addr[line] = addr;
+	cache_valid |= 1 << line;
+	return line;
+}
+#else
+#define cache_drop(addr, count)
+#endif
+
+/* transmit/receive arbitrary data on the SPI */
+void avr_spi(const char *tx, char *rx, unsigned char len)
+{
+	wait();
+	cache_drop(0, 0);  /* it could be anything */
+	spi(tx, rx, len);
+}
+
+/* send a reset pulse to the AVR */
+static __bit prog_en;
+void avr_reset(void)
+{
+	wait();
+	RESET(0);
+	timer_delay_ms(1);
+	RESET(1);
+	prog_en = 0;
+	cache_drop(0, 0);
 }
 
+#ifdef GANG
+/* drop targets from the gang, recording why */
+static void gang_drop(unsigned char mask, char reason)
+{
+	unsigned char t;
+	mask &= gang;
+	if (!mask)
+		return;
+	for (t = 0; t < GANG; ++t)
+		if (mask & 1 << t)
+			gang_reason[t] = reason;
+	gang &= ~mask;
+	for (gang_first = 0; gang_first < GANG - 1
+			&& !(gang & 1 << gang_first); ++gang_first);
+	if (prog_en)
+		RESET(0);  /* let the dropped ones go */
+	if (!gang)
+		prog_en = 0;
+}
+
+/* choose the targets to program from now on, and forget earlier failures */
+void avr_gang_select(unsigned char mask)
+{
+	unsigned char t;
+	avr_reset();
+	gang = mask & ((1 << GANG) - 1);
+	for (t = 0; t < GANG; ++t)
+		gang_reason[t] = 0;
+	for (gang_first = 0; gang_first < GANG - 1
+			&& !(gang & 1 << gang_first); ++gang_first);
+}
+
+/* return AVR_GANG_OK if a target is still in the gang, or else why not */
+char avr_gang_status(unsigned char t)
+{
+	if (gang & 1 << t)
+		return AVR_GANG_OK;
+	return gang_reason[t] ? gang_reason[t] : AVR_GANG_OFF;
+}
+#endif
+
 /* test whether the AVR is in serial programming mode */
 __bit avr_is_programming_enabled(void)
 {
 	return prog_en;
 }
 
-/* put the AVR into serial programming mode; return zero on success, or non-zero
- * on failure */
+/* look the part up by its signature */
+static void identify(void)
+{
+	unsigned char i, sig[3];
+	for (i = 0; i < 3; ++i) {
+		sig[i] = avr_signature(i);
+#ifdef GANG
+		gang_drop(gang_differ(sig[i], 0xff), AVR_GANG_SIGNATURE);
+#endif
+	}
+	avr_device = devices;
+	for (i = 1; i < sizeof devices / sizeof *devices; ++i)
+		if (devices[i].signature[0] == sig[0]
+				&& devices[i].signature[1] == sig[1]
+				&& devices[i].signature[2] == sig[2]) {
+			avr_device = devices + i;
+			break;
+		}
+}
+
+/* read the signature twice and check that it reads the same both times and
+ * starts with the manufacturer code (0x1e for Atmel); a link that is too fast
+ * for the target will usually garble at least one of the bytes */
+#ifndef GANG
+static __bit is_in_sync(void)
+{
+	unsigned char i;
+	for (i = 0; i < 3; ++i)
+		if (avr_signature(i) != avr_signature(i))
+			return 0;
+	return avr_signature(0) == 0x1e;
+}
+#else
+/* as is_in_sync(), returning the targets in the gang that are not */
+static unsigned char gang_out_of_sync(void)
+{
+	unsigned char i, t, mask = 0, first[GANG];
+	for (i = 0; i < 3; ++i) {
+		avr_signature(i);
+		for (t = 0; t < GANG; ++t)
+			first[t] = gang_rx[t];
+		avr_signature(i);
+		for (t = 0; t < GANG; ++t)
+			if (gang_rx[t] != first[t])
+				mask |= 1 << t;
+	}
+	avr_signature(0);
+	return (mask | gang_differ(0x1e, 0xff)) & gang;
+}
+#endif
+
+/* return the index of the SCK rate in effect, where 0 is the fastest */
+unsigned char avr_sck(void)
+{
+	return sck;
+}
+
+/* put the AVR into serial programming mode at the fastest SCK rate it keeps up
+ * with, and identify it; return zero on success, or non-zero on failure */
 __bit avr_programming_enable(void)
 {
 	static const unsigned char tx[] = {0xac, 0x53, 0, 0};
 	unsigned char i, rx[sizeof tx];
-	for (i = 0; i < 20; ++i) {
+#ifdef GANG
+	unsigned char unsynced;
+#endif
+	wait();
+	cache_drop(0, 0);  /* it may be another AVR now */
+	for (i = 0; i < 5 * SCK_RATES; ++i) {
+		sck_set(i % SCK_RATES);  /* fastest to slowest, and around */
+
 		/* as per the AVR datasheet:
 		 * "In some systems, the programmer can not guarantee that SCK
 		 * is held low during power-up. In this case, RESET must be
 		 * given a positive pulse after SCK has been set to '0'. The
 		 * duration of the pulse must be at least t(RST) plus two CPU
 		 * clock cycles." */
-		AVR_RESET = 1;
-		delay_ms(1);
-		AVR_RESET = 0;
+		RESET(1);
+		timer_delay_ms(1);
+		RESET(0);
 
 		/* "Wait for at least 20 ms and enable serial programming by
 		 * sending the Programming Enable serial instruction to pin
 		 * MOSI." */
-		delay_ms(20);
+		timer_delay_ms(20);
 
 		/* "The serial programming instructions will not work if the
 		 * communication is out of synchronization. When in sync. the
@@ -85,51 +597,77 @@ __bit avr_programming_enable(void)
 		 * is correct or not, all four bytes of the instruction must be
 		 * transmitted. If the 0x53 did not echo back, give RESET a
 		 * positive pulse and issue a new Programming Enable command." */
+#ifndef GANG
 		spi_xcv(tx, rx);
-		if (rx[2] == tx[1]) {
+		if (IN_SYNC(rx, tx)) {
 			prog_en = 1;
+			identify();
 			return 0;
 		}
+#else
+		/* every target has to echo, and then read a steady signature;
+		 * any that still don't on the last, and slowest, attempt are
+		 * dropped, and the rest carry on */
+		spi(tx, rx, 3);
+		unsynced = gang_differ(tx[1], 0xff);
+		spi(tx + 3, rx + 3, 1);
+		unsynced |= gang_out_of_sync();
+		if (!unsynced || i == 5 * SCK_RATES - 1) {
+			gang_drop(unsynced, AVR_GANG_SYNC);
+			if (!gang)
+				break;
+			prog_en = 1;
+			identify();
+			return !prog_en;
+		}
+#endif
+		++avr_stats.retries;
 	}
 	return 1;
 }
 
-/* poll the !RDY/BSY flag and non-zero if ready, or zero if not */
-static __bit is_rdy(void)
-{
-	static const unsigned char tx[] = {0xf0, 0, 0, 0};
-	unsigned char rx[sizeof tx];
-	spi_xcv(tx, rx);
-	return !(rx[3] & 1);
-}
-
 /* read a device signature byte */
 unsigned char avr_signature(unsigned char addr)
 {
 	unsigned char buf[4] = {0x30, 0, addr % 0x3};
+	wait();
 	spi_xcv(buf, buf);
 	return buf[3];
 }
 
-/* send a chip-erase instruction */
+/* start a chip erase */
 void avr_erase(void)
 {
 	static const unsigned char tx[] = {0xac, 0x80, 0, 0};
 	unsigned char rx[sizeof tx];
+	wait();
 	spi_xcv(tx, rx);
-	while (!is_rdy());
+	cache_drop(0, 0);
+	poll_value = 0xff;  /* everything reads 0xff afterwards */
+	start(AVR_OP_ERASE, avr_device->t_wd_erase);
 }
 
 /* read an arbitrary byte address from program memory */
 unsigned char avr_flash_read(unsigned short addr)
 {
-	unsigned char buf[4] = {
-		addr % 2 ? 0x28 : 0x20,
-		addr / 2 / 0x100,
-		addr / 2 & 0xff,
-	};
-	spi_xcv(buf, buf);
-	return buf[3];
+#if AVR_CACHE_LINES
+	unsigned short line_addr = addr & ~(AVR_CACHE_LINE - 1);
+	unsigned char i;
+	for (i = 0; i < AVR_CACHE_LINES; ++i)
+		if (cache_valid & 1 << i && cache_addr[i] == line_addr)
+			break;
+	if (i == AVR_CACHE_LINES)
+		i = fill(line_addr);
+	else
+		++avr_stats.cache_hits;
+	return cache[i][addr & AVR_CACHE_LINE - 1];
+#else
+	unsigned char value;
+	wait();
+	value = flash_read(addr);
+	VERIFY(value);
+	return value;
+#endif
 }
 
 /* load a byte value to the temporary page buffer */
@@ -141,10 +679,46 @@ void avr_flash_load(unsigned short addr, unsigned char value)
 		addr / 2 & 0xff,
 		value,
 	};
+	wait();
 	spi_xcv(buf, buf);
+	if (value != 0xff) {
+		poll_addr = addr;
+		poll_value = value;
+	}
 }
 
-/* write the temporary page buffer to program memory */
+/* load a run of consecutive bytes to the temporary page buffer, streaming the
+ * load instructions back to back */
+void avr_flash_load_page(unsigned short addr, const unsigned char *data,
+		unsigned char len)
+{
+	unsigned char op = addr & 1 ? 0x48 : 0x40, hi = addr >> 9, lo = addr >> 1;
+	unsigned char i;
+#ifdef TRACE
+	unsigned char event[5] = {op, hi, lo, len};
+	trace(TRACE_LOAD, event);
+#endif
+	wait();
+	avr_stats.instructions += len;
+	if (wait_mode == AVR_WAIT_DATA)  /* find something to read back */
+		for (i = len; i--;)
+			if (data[i] != 0xff) {
+				poll_addr = addr + i;
+				poll_value = data[i];
+				break;
+			}
+	for (; len; --len) {
+		spi_tx(op);
+		spi_tx(hi);
+		spi_tx(lo);
+		spi_tx(*data++);
+		op ^= 0x48 ^ 0x40;  /* alternate between the low and high bytes */
+		if (op == 0x40 && !++lo)
+			++hi;
+	}
+}
+
+/* start writing the temporary page buffer to program memory */
 void avr_flash_write(unsigned short addr)
 {
 	unsigned char buf[4] = {
@@ -153,22 +727,62 @@ void avr_flash_write(unsigned short addr)
 		addr / 2 & 0xff,
 		0,
 	};
+	wait();
 	spi_xcv(buf, buf);
-	while (!is_rdy());
+	cache_drop(addr & ~(avr_device->flash_page - 1),  /* all, for 0x100 */
+			avr_device->flash_page);
+	start(AVR_OP_FLASH, avr_device->t_wd_flash);
 }
 
 /* read from an arbitrary byte address in EEPROM */
-unsigned char avr_eeprom_read(unsigned char addr)
+unsigned char avr_eeprom_read(unsigned short addr)
+{
+	unsigned char value;
+	wait();
+	value = eeprom_read(addr);
+	VERIFY(value);
+	return value;
+}
+
+/* start writing to an arbitrary byte address in EEPROM */
+void avr_eeprom_write(unsigned short addr, unsigned char value)
 {
-	unsigned char buf[4] = {0xa0, 0, addr};
+	unsigned char buf[4] = {0xc0, addr >> 8, addr & 0xff, value};
+	wait();
 	spi_xcv(buf, buf);
-	return buf[3];
+	poll_addr = addr;
+	poll_value = value;
+	start(AVR_OP_EEPROM, avr_device->t_wd_eeprom);
 }
 
-/* write to an arbitrary byte address in EEPROM */
-void avr_eeprom_write(unsigned char addr, unsigned char value)
+/* load a byte value to the temporary EEPROM page buffer; only the locations
+ * loaded are written by avr_eeprom_write_page() */
+void avr_eeprom_load(unsigned short addr, unsigned char value)
 {
-	unsigned char buf[4] = {0xc0, 0, addr, value};
+	unsigned char buf[4] = {
+		0xc1,
+		0,
+		addr & avr_device->eeprom_page - 1,
+		value,
+	};
+	wait();
+	spi_xcv(buf, buf);
+	if (value != 0xff) {
+		poll_addr = addr;
+		poll_value = value;
+	}
+}
+
+/* start writing the temporary EEPROM page buffer to EEPROM */
+void avr_eeprom_write_page(unsigned short addr)
+{
+	unsigned char buf[4] = {
+		0xc2,
+		addr >> 8,
+		addr & ~(avr_device->eeprom_page - 1) & 0xff,
+		0,
+	};
+	wait();
 	spi_xcv(buf, buf);
-	while (!is_rdy());
+	start(AVR_OP_EEPROM, avr_device->t_wd_eeprom);
 }
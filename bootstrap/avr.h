@@ -3,16 +3,107 @@
 
 #define AVR_RESET P1_0
 
+/* gang programming (-DGANG=<n>, with SPI_SW): up to four identical targets
+ * share SCK and MOSI, and target i has its MISO on P2.i and its reset on
+ * P2.(4 + i); every instruction goes to all of the targets in the gang at once,
+ * reads return what the lowest-numbered one sent, and a target that fails is
+ * dropped from the gang, for one of these reasons, until avr_gang_select() */
+#ifdef GANG
+#if GANG > 4
+#error at most four targets can be ganged
+#endif
+#ifndef SPI_SW
+#error gang programming needs SPI_SW
+#endif
+#define AVR_GANG_OK '.'
+#define AVR_GANG_OFF '-'  /* not selected */
+#define AVR_GANG_SYNC 'S'  /* no 0x53 echo, or an unsteady signature */
+#define AVR_GANG_SIGNATURE 'G'  /* differs from the first target's */
+#define AVR_GANG_VERIFY 'V'  /* read back differently from the first target */
+#define AVR_GANG_BUSY 'B'  /* still busy long after a write cycle's t(WD) */
+#endif
+
+/* the largest flash page the bootstrap buffers; parts with larger pages are
+ * written a chunk of this size at a time */
+#ifndef AVR_PAGE_MAX
+#define AVR_PAGE_MAX 0x80
+#endif
+
+/* program memory reads are served from a cache in XRAM of AVR_CACHE_LINES
+ * lines of AVR_CACHE_LINE bytes (a power of two), or 0 lines for none, which is
+ * the default for the PROFILE and TRACE builds, to make room in the 768 bytes
+ * of XRAM for their counters (see the Makefile) */
+#ifndef AVR_CACHE_LINES
+#if defined PROFILE || defined TRACE
+#define AVR_CACHE_LINES 0
+#else
+#define AVR_CACHE_LINES 2
+#endif
+#endif
+#define AVR_CACHE_LINE 0x40
+
+/* serial programming parameters of a part, looked up by its signature */
+struct avr_device {
+	unsigned char signature[3];
+	unsigned short flash_size;  /* bytes */
+	unsigned char flash_page;  /* bytes */
+	unsigned short eeprom_size;  /* bytes */
+	unsigned char eeprom_page;  /* bytes, or 1 for byte writes only */
+	unsigned char t_wd_flash;  /* write delays in units of 100 us */
+	unsigned char t_wd_eeprom;
+	unsigned char t_wd_erase;
+};
+extern const struct avr_device *avr_device;
+
+/* ways of detecting the end of a write cycle (see avr_set_wait()) */
+#define AVR_WAIT_RDY 0
+#define AVR_WAIT_DATA 1
+#define AVR_WAIT_TIME 2
+
+/* write cycles, and how long they have taken since avr_set_wait() */
+#define AVR_OP_FLASH 0
+#define AVR_OP_EEPROM 1
+#define AVR_OP_ERASE 2
+struct avr_wait_stats {
+	unsigned short count;  /* write cycles */
+	unsigned short polls;  /* instructions sent to see if they were done */
+	unsigned short ticks;  /* in units of 100 us */
+	unsigned short max;  /* ticks taken by the longest */
+};
+extern struct avr_wait_stats avr_wait_stats[3];
+
+/* counters since power-on, for the "stats" command */
+struct avr_stats {
+	unsigned long instructions;  /* sent on the SPI */
+	unsigned short writes;  /* write cycles */
+	unsigned long polls;  /* instructions sent to see if they were done */
+	unsigned short retries;  /* failed programming enable attempts */
+	unsigned long cache_hits;  /* program memory bytes read from the cache */
+	unsigned short cache_misses;  /* lines read from the AVR to fill it */
+};
+extern struct avr_stats avr_stats;
+
 void avr_reset(void);
 void avr_spi(const char *, char *, unsigned char);
+__bit avr_busy(void);
+void avr_set_wait(unsigned char);
+unsigned char avr_get_wait(void);
 __bit avr_is_programming_enabled(void);
 __bit avr_programming_enable(void);
+unsigned char avr_sck(void);
 unsigned char avr_signature(unsigned char);
 void avr_erase(void);
 unsigned char avr_flash_read(unsigned short);
 void avr_flash_load(unsigned short, unsigned char);
+void avr_flash_load_page(unsigned short, const unsigned char *, unsigned char);
 void avr_flash_write(unsigned short);
-unsigned char avr_eeprom_read(unsigned char);
-void avr_eeprom_write(unsigned char, unsigned char);
+unsigned char avr_eeprom_read(unsigned short);
+void avr_eeprom_write(unsigned short, unsigned char);
+void avr_eeprom_load(unsigned short, unsigned char);
+void avr_eeprom_write_page(unsigned short);
+#ifdef GANG
+void avr_gang_select(unsigned char);
+char avr_gang_status(unsigned char);
+#endif
 
 #endif
@@ -1,8 +1,13 @@
 #include <mcs51/p89v51rd2.h>
 
 #include "avr.h"
+#include "iap.h"
+#include "profile.h"
 #include "stdio.h"
-void stdio_isr(void) __interrupt (SI0_VECTOR);
+#include "timer.h"
+#include "trace.h"
+void stdio_isr(void) __interrupt (SI0_VECTOR) __using (1);
+void timer1_isr(void) __interrupt (TF1_VECTOR) __using (1);
 
 #define SCON_RI 0x01
 #define SCON_TI 0x02
@@ -33,6 +38,11 @@ void stdio_isr(void) __interrupt (SI0_VECTOR);
 
 #define IS_WHITESPACE(c) ((c) < '!' || '~' < (c))
 
+/* the burn button, between this pin and ground (see burn_poll()) */
+#ifndef BURN_BUTTON
+#define BURN_BUTTON P3_2
+#endif
+
 /* parse a single ASCII hexadecimal character; return zero on success, non-zero
  * if the character is not valid hexadecimal */
 static __bit parse_hex(char c, unsigned char *dest)
@@ -95,83 +105,538 @@ static char strncmp(const char *s1, const char *s2, unsigned char n)
 	return 0;
 }
 
-static inline void ihex_write(unsigned short page, const unsigned char *data)
+/* the size of the pages the bootstrap writes: the part's, up to AVR_PAGE_MAX */
+static unsigned char page_size(void)
 {
-	unsigned char i;
-	for (i = 0; i < 0x20; ++i)
-		avr_flash_load(page + i, data[i]);
-	avr_flash_write(page);
+	unsigned char size = avr_device->flash_page;
+	return size && size <= AVR_PAGE_MAX ? size : AVR_PAGE_MAX;
+}
+
+/* the size of the EEPROM pages the bootstrap writes: the part's, up to 8 so
+ * that the locations present fit in a mask */
+static unsigned char eeprom_page_size(void)
+{
+	unsigned char size = avr_device->eeprom_page;
+	return size <= 8 ? size : 8;
 }
 
 static inline void ihex_clear(unsigned char *data)
 {
-	unsigned char i;
-	for (i = 0; i < 0x20; ++i)
+	unsigned char i, size = page_size();
+	for (i = 0; i < size; ++i)
 		data[i] = 0xff;
 }
 
-/* process an Intel HEX record from the command line; return an ASCII character
- * representing a status code to be printed:
+/* update a CRC-16/CCITT (polynomial 0x1021, MSB first) with one byte */
+static unsigned short crc16(unsigned short crc, unsigned char c)
+{
+	c ^= crc >> 8;
+	c ^= c >> 4;
+	return crc << 8 ^ (unsigned short)c << 12 ^ (unsigned short)c << 5 ^ c;
+}
+
+/* Intel HEX data is assembled a page at a time; a completed page waits in the
+ * other buffer until the AVR has finished writing the one before it, so that
+ * the next page can be filled from incoming records in the meantime
+ *
+ * records following an extended linear address record of 0x0081 are EEPROM
+ * data (at 0x810000, where avr-gcc puts it), written an EEPROM page at a time;
+ * only the locations present in the records are written there */
+static unsigned char ihex_buf[2][AVR_PAGE_MAX];
+static unsigned char *ihex_fill = ihex_buf[0], *ihex_full = ihex_buf[1];
+static unsigned short ihex_page = 0xffff;  /* address of ihex_fill */
+static unsigned short ihex_pending = 0xffff;  /* address of ihex_full */
+static unsigned char ihex_fill_mask, ihex_full_mask;  /* EEPROM locations */
+static __bit ihex_eeprom, ihex_pending_eeprom;  /* are the pages EEPROM? */
+
+static void ihex_write(void)
+{
+	unsigned char i, size;
+	if (!ihex_pending_eeprom) {
+		avr_flash_load_page(ihex_pending, ihex_full, page_size());
+		avr_flash_write(ihex_pending);
+	} else if ((size = eeprom_page_size()) == 1) {
+		avr_eeprom_write(ihex_pending, *ihex_full);
+	} else {
+		for (i = 0; i < size; ++i)
+			if (ihex_full_mask & 1 << i)
+				avr_eeprom_load(ihex_pending + i, ihex_full[i]);
+		avr_eeprom_write_page(ihex_pending);
+	}
+}
+
+/* start writing the pending page as soon as the AVR is ready for it; return
+ * non-zero while it is still pending */
+static __bit ihex_poll(void)
+{
+	if (ihex_pending != 0xffff && !avr_busy()) {
+		ihex_write();
+		ihex_pending = 0xffff;
+	}
+	return ihex_pending != 0xffff;
+}
+
+/* hand the page being filled over to be written, first waiting for the one
+ * before it if necessary */
+static void ihex_commit(void)
+{
+	unsigned char *data = ihex_full;
+	while (ihex_poll());
+	ihex_full = ihex_fill;
+	ihex_fill = data;
+	ihex_full_mask = ihex_fill_mask;
+	ihex_pending_eeprom = ihex_eeprom;
+	ihex_pending = ihex_page;
+	ihex_page = 0xffff;
+	ihex_poll();
+}
+
+/* get a character, writing out a pending page while waiting for it (and
+ * looking at timer 0, so that its ticks are counted); at the start of a line,
+ * the burn button may burn an image in the meantime */
+static __bit repl_idle, storing;
+static void burn_poll(void);
+static char getchar_poll(void)
+{
+	while (!stdio_rx_ready()) {
+		ihex_poll();
+		timer_ticks();
+		if (repl_idle && !storing)
+			burn_poll();
+	}
+	return getchar();
+}
+
+/* while "burn" verifies, data is compared with what the AVR reads back rather
+ * than stored, and the bytes that differ are counted */
+static __bit ihex_verify;
+static unsigned short ihex_mismatches;
+
+/* store a byte of data at an address, in the page being filled or, handing
+ * that over to be written, in a new one */
+static void ihex_store(unsigned short addr, unsigned char c, unsigned char mask)
+{
+	unsigned short newpage = addr & ~mask;
+	unsigned char dest = addr & mask;
+	if (ihex_verify) {
+		if ((ihex_eeprom ? avr_eeprom_read(addr) : avr_flash_read(addr))
+				!= c)
+			++ihex_mismatches;
+		return;
+	}
+	if (newpage != ihex_page) {
+		if (ihex_page != 0xffff)
+			ihex_commit();
+		ihex_clear(ihex_fill);
+		ihex_fill_mask = 0;
+		ihex_page = newpage;
+	}
+	ihex_fill[dest] = c;
+	if (ihex_eeprom)
+		ihex_fill_mask |= 1 << dest;
+}
+
+/* packed data records (type 0x10, not one of Intel's) carry flash data as a
+ * sequence of tokens, each of them whole within a record, which unpack to
+ * consecutive addresses from the record's:
+ *  0x00-0x7f  n + 1 literal bytes follow
+ *  0x80-0xbf  the next byte, repeated (n & 0x3f) + 3 times
+ *  0xc0-0xff  (n & 0x3f) + 3 bytes copied from d + 1 bytes back in what was
+ *             unpacked before, d < UNPACK_WINDOW being the next byte
+ * blank bytes that would start a page are skipped, so a page left blank by the
+ * chip erase is not written at all */
+#define UNPACK_WINDOW 0x80
+static __xdata unsigned char unpack_window[UNPACK_WINDOW];
+static unsigned char unpack_head;  /* where the next byte goes in the window */
+
+/* the last upload of packed data: bytes received and unpacked, and ticks from
+ * its first packed record to the end-of-file record, timed by timer 1, since
+ * timer 0's ticks go uncounted through the page loads and write cycles */
+static unsigned short unpack_in, unpack_out;
+static unsigned long unpack_start, unpack_ticks;
+static __bit unpacking;
+
+static void unpack_put(unsigned short addr, unsigned char c, unsigned char mask)
+{
+	unpack_window[unpack_head++ % UNPACK_WINDOW] = c;
+	if (c != 0xff || ihex_verify || (addr & ~mask) == ihex_page)
+		ihex_store(addr, c, mask);
+}
+
+/* unpack a packed data record's tokens; return non-zero if one of them runs
+ * past its end */
+static __bit unpack(const unsigned char *src, unsigned char len,
+		unsigned short addr, unsigned char mask)
+{
+	const unsigned char *end = src + len;
+	if (!unpacking) {
+		unpacking = 1;
+		unpack_in = unpack_out = 0;
+		unpack_ticks = 0;
+		unpack_start = timer_cycles();
+	}
+	unpack_in += len;
+	while (src != end) {
+		unsigned char op = *src++, n;
+		if (op < 0x80) {
+			n = op + 1;
+			if (n > end - src)
+				return 1;
+			unpack_out += n;
+			while (n--)
+				unpack_put(addr++, *src++, mask);
+			continue;
+		}
+		if (src == end)
+			return 1;
+		n = (op & 0x3f) + 3;
+		unpack_out += n;
+		if (op < 0xc0) {
+			unsigned char c = *src++;
+			while (n--)
+				unpack_put(addr++, c, mask);
+		} else {
+			unsigned char from = unpack_head - *src++ - 1;
+			while (n--)
+				unpack_put(addr++,
+					unpack_window[from++ % UNPACK_WINDOW],
+					mask);
+		}
+	}
+	return 0;
+}
+
+/* process a decoded Intel HEX record (length, address, type and data, with
+ * the checksum already verified); return an ASCII character representing a
+ * status code to be printed:
  *  '.'  success
- *  'C'  checksum error
+ *  'A'  extended linear address other than 0 (flash) or 0x0081 (EEPROM)
  *  'L'  data length exceeds the maximum of 32 bytes
  *  'P'  programming mode has not been enabled
- *  'T'  unrecognized record type */
-static char ihex(const unsigned char *buf, unsigned char len)
+ *  'T'  unrecognized record type, or packed data for EEPROM
+ *  'U'  a packed data token runs past the end of the record */
+static char ihex_apply(const unsigned char *buf, unsigned char len)
 {
-	static unsigned short page = 0xffff;
-	static unsigned char data[0x20];
-	unsigned char i, checksum = buf[len + 4];
+	unsigned char i, mask = (ihex_eeprom ? eeprom_page_size()
+			: page_size()) - 1;
 	if (!avr_is_programming_enabled())
 		return 'P';
-	for (i = 0; i < len + 4; ++i)
-		checksum += buf[i];
-	if (checksum)  /* checksum  error */
-		return 'C';
-	if (len > sizeof data)  /* data length in excess */
+	if (len > 0x20)  /* data length in excess */
 		return 'L';
-	if (!buf[3]) {  /* data */
+	if (!buf[3] || buf[3] == 0x10) {  /* data, or packed data */
 		union {
 			unsigned char u8[2];
 			unsigned short u16;
 		} addr;
 		addr.u8[0] = buf[2];
 		addr.u8[1] = buf[1];
-		for (i = 0; i < len; ++i, ++addr.u16) {
-			unsigned short newpage = addr.u16 & ~0x1f;
-			unsigned char dest = addr.u16 % sizeof data;
-			if (newpage != page) {
-				if (page != 0xffff)
-					ihex_write(page, data);
-				ihex_clear(data);
-				page = newpage;
-			}
-			data[dest] = buf[i + 4];
+		if (buf[3]) {
+			if (ihex_eeprom)
+				return 'T';
+			if (unpack(buf + 4, len, addr.u16, mask))
+				return 'U';
+		} else {
+			for (i = 0; i < len; ++i, ++addr.u16)
+				ihex_store(addr.u16, buf[i + 4], mask);
 		}
 	} else if (buf[3] == 1) {  /* end of file */
-		if (page != 0xffff)
-			ihex_write(page, data);
-		page = 0xffff;
+		if (ihex_page != 0xffff)
+			ihex_commit();
+		ihex_eeprom = 0;
+		if (unpacking) {
+			unpack_ticks = (timer_cycles() - unpack_start)
+					/ TIMER_TICK_CYCLES;
+			unpacking = 0;
+		}
+	} else if (buf[3] == 4) {  /* extended linear address */
+		if (len != 2 || buf[4] || buf[5] && buf[5] != 0x81)
+			return 'A';
+		if (ihex_page != 0xffff)
+			ihex_commit();
+		ihex_eeprom = buf[5];
 	} else {  /* unrecognized type */
 		return 'T';
 	}
 	return '.';
 }
 
+/* target images kept in the P89V51RD2's own flash (see iap.h), for "burn" to
+ * program with no host: each is the sequence of decoded records it was
+ * uploaded as (length, address, type and data, as ihex_apply() takes them) up
+ * to its end-of-file record, and the store ends at the first record length
+ * that is still blank (0xff, longer than any record) */
+#define STORE(offset) (*iap_ptr(IAP_STORE + (offset)))
+static unsigned short store_end;  /* offset of that blank byte */
+static unsigned short store_last;  /* where the last complete image ends */
+static unsigned char store_images;  /* complete images */
+static char store_status;  /* '.', or why the image being added failed */
+
+/* walk the store to its end */
+static void store_scan(void)
+{
+	unsigned short offset = 0;
+	store_images = 0;
+	store_last = 0;
+	while (offset < IAP_STORE_SIZE && STORE(offset) != 0xff) {
+		unsigned char type = STORE(offset + 3);
+		offset += STORE(offset) + 4;
+		if (type == 1) {  /* end of file */
+			++store_images;
+			store_last = offset;
+		}
+	}
+	store_end = offset < IAP_STORE_SIZE ? offset : IAP_STORE_SIZE;
+}
+
+/* return the offset of an image in the store, or IAP_STORE_SIZE if there is no
+ * such image */
+static unsigned short store_find(unsigned char n)
+{
+	unsigned short offset = 0;
+	while (n && offset < store_last) {
+		if (STORE(offset + 3) == 1)
+			--n;
+		offset += STORE(offset) + 4;
+	}
+	return offset < store_last ? offset : IAP_STORE_SIZE;
+}
+
+/* add a decoded record to the image being stored, which its end-of-file record
+ * completes; return a status as for ihex_apply(), or:
+ *  'F'  the store is full
+ *  'I'  programming the store failed
+ * once a record fails, so does every other up to the end-of-file record, and
+ * the image is left incomplete */
+static char store_record(const unsigned char *buf, unsigned char len)
+{
+	unsigned char i;
+	char status;
+	if (store_status != '.')
+		status = store_status;
+	else if (len > 0x20)
+		status = 'L';
+	else if (buf[3] == 4 && (len != 2 || buf[4] || buf[5] && buf[5] != 0x81))
+		status = 'A';
+	else if (buf[3] > 1 && buf[3] != 4 && buf[3] != 0x10)
+		status = 'T';
+	else if (IAP_STORE_SIZE - store_end < len + 4)
+		status = 'F';
+	else
+		status = '.';
+	for (i = 0; status == '.' && i < len + 4; ++i)
+		if (iap_program(IAP_STORE + store_end + i, buf[i]))
+			status = 'I';
+	if (status == '.')
+		store_end += len + 4;
+	else
+		store_status = status;
+	if (buf[3] == 1)
+		storing = 0;
+	return status;
+}
+
+/* process a decoded Intel HEX record as ihex_apply() does, or add it to the
+ * store after "store add", counting it */
+static unsigned short records;
+static char ihex_record(const unsigned char *buf, unsigned char len)
+{
+	char status = storing ? store_record(buf, len) : ihex_apply(buf, len);
+	++records;
+#ifdef TRACE
+	{
+		unsigned char event[5] = {buf[3], buf[1], buf[2], len, status};
+		trace(TRACE_RECORD, event);
+	}
+#endif
+	return status;
+}
+
+/* process an Intel HEX record from the command line; return a status code as
+ * for ihex_record(), or:
+ *  'C'  checksum error */
+static char ihex(const unsigned char *buf, unsigned char len)
+{
+	unsigned char i, checksum = buf[len + 4];
+	for (i = 0; i < len + 4; ++i)
+		checksum += buf[i];
+	if (checksum)  /* checksum  error */
+		return 'C';
+	return ihex_record(buf, len);
+}
+
+/* wait up to a second for a given character, ignoring any others; return
+ * non-zero if it was received */
+static __bit sync(char c)
+{
+	unsigned short start = timer_ticks();
+	while ((unsigned short)(timer_ticks() - start)
+			< 1000 * TIMER_TICKS_PER_MS)
+		if (stdio_rx_ready() && getchar() == c)
+			return 1;
+	return 0;
+}
+
+static void set_baud_reload(unsigned short reload)
+{
+	RCAP2L = reload;
+	RCAP2H = reload >> 8;
+}
+
+/* switch the UART to a decimal baud rate within 2% of one that timer 2 can
+ * generate (F_CPU / 32 / n); after "ok", the host has a second to send 'U' at
+ * the new rate, which is echoed, and another to confirm with 'K', or else the
+ * old rate is restored */
+static __bit eval_baud(const char *args, unsigned char len)
+{
+	unsigned long rate = 0, n, actual;
+	unsigned short old = RCAP2H << 8 | RCAP2L;
+	for (; len && '0' <= *args && *args <= '9'; --len, ++args)
+		rate = rate * 10 + *args - '0';
+	if (!rate || len)
+		return 1;
+	n = (F_CPU / 32 + rate / 2) / rate;
+	actual = n * rate;  /* compared with F_CPU / 32 rather than divided */
+	if (!n || n > 0xffff || (actual < F_CPU / 32 ? F_CPU / 32 - actual
+				: actual - F_CPU / 32) * 50 > actual) {
+		puts("baud: not within 2% of a rate timer 2 can generate\n");
+		return 0;
+	}
+	puts("ok\n");
+	stdio_flush();
+	set_baud_reload(-n);
+	while (stdio_rx_ready())  /* whatever came in while switching */
+		getchar();
+	if (sync('U')) {
+		stdio_tx('U');
+		if (sync('K'))
+			return 0;
+	}
+	stdio_flush();
+	set_baud_reload(old);
+	puts("baud: no response at the new rate\n");
+	return 0;
+}
+
+/* receive Intel HEX records as binary frames until the end-of-file record;
+ * each frame is a sequence number, the record's length, address, type and data
+ * bytes, and a big-endian CRC-16 of all of them in place of the checksum
+ *
+ * on entry, the free space in the receive buffer is printed in hexadecimal so
+ * the host may keep that many bytes of frames in flight; every frame is then
+ * acknowledged by the status character returned by ihex_record() followed by
+ * the frame's sequence number as a hexadecimal digit, or:
+ *  'C'  CRC error
+ *  'S'  out of sequence (dropped; expecting the given sequence number)
+ * after either of which everything up to a resend of the expected frame is
+ * dropped */
+static __bit eval_binary(const char *args, unsigned char len)
+{
+	static unsigned char buf[1 + 4 + 0x20 + 2];
+	unsigned char seq = 0;
+	(void)args;
+	(void)len;
+	if (!storing && !avr_is_programming_enabled()) {
+		puts("binary: device is not in serial programming mode;"
+				" use \"reset prog\"\n");
+		return 0;
+	}
+	print_hex(stdio_rx_free());
+	putchar('\n');
+	while (1) {
+		unsigned short crc = 0xffff;
+		unsigned char i;
+		char status;
+		buf[0] = getchar_poll();
+		buf[1] = getchar_poll();
+		if (buf[1] > sizeof buf - 7) {  /* out of sync; give up */
+			putchar('L');
+			return 0;
+		}
+		for (i = 2; i < buf[1] + 7; ++i)
+			buf[i] = getchar_poll();
+		for (i = 0; i < buf[1] + 7; ++i)
+			crc = crc16(crc, buf[i]);
+		if (crc) {
+			status = 'C';
+		} else if ((buf[0] ^ seq) & 0xf) {
+			status = 'S';
+		} else {
+			status = ihex_record(buf + 1, buf[1]);
+			++seq;
+		}
+		putchar(status);
+		i = (status == 'C' || status == 'S' ? seq : seq - 1) & 0xf;
+		putchar(i + (i > 9 ? 'a' - 0xa : '0'));
+		if (status == '.' && buf[4] == 1)  /* end of file */
+			return 0;
+	}
+}
+
+/* print a CRC-16 of each page of program memory in the given range, so that
+ * the host can tell which pages differ from an image without reading them */
+static __bit eval_crc(const char *args, unsigned char len)
+{
+	const char *end;
+	unsigned short addr, count;
+	unsigned char size = page_size();
+	if (!len)
+		return 1;
+	addr = strtoh(args, &end);
+	if (end == args || !IS_WHITESPACE(*end))
+		return 1;
+	count = strtoh(end, &args);
+	if (args == end || *args && !IS_WHITESPACE(*args))
+		return 1;
+	if (addr & size - 1) {
+		puts("crc: ");
+		print_hex(addr >> 8);
+		print_hex(addr & 0xff);
+		puts(" is not on a page boundary\n");
+		return 0;
+	}
+	if (!avr_is_programming_enabled()) {
+		puts("crc: device is not in serial programming mode;"
+				" use \"reset prog\"\n");
+		return 0;
+	}
+	while (count) {
+		unsigned short crc = 0xffff;
+		unsigned char i;
+		for (i = 0; i < size; ++i)
+			crc = crc16(crc, avr_flash_read(addr + i));
+		print_hex(crc >> 8);
+		print_hex(crc & 0xff);
+		addr += size;
+		count = count > size ? count - size : 0;
+		if (count)
+			putchar(' ');
+	}
+	putchar('\n');
+	return 0;
+}
+
+/* dump EEPROM, or read a byte from it, or write consecutive bytes to it, a page
+ * at a time */
 static __bit eval_eeprom(const char *args, unsigned char len)
 {
 	const char *end;
-	unsigned char addr, value;
+	unsigned short addr;
+	unsigned char i, mask, data[25];  /* (80 - 10 ("eeprom XXX")) / 3 */
 	if (!avr_is_programming_enabled()) {
 		puts("eeprom: device is not in serial programming mode;"
 				" use \"reset prog\"\n");
 		return 0;
 	}
 	if (!len) {
-		for (addr = 0; addr < 0x80; addr += 0x10) {
-			unsigned char i, j, buf[0x10 + 1];
-			puts("  ");
-			print_hex(addr);
+		unsigned short size = avr_device->eeprom_size;
+		for (addr = 0; addr < size; addr += 0x10) {
+			unsigned short i, j;
+			unsigned char buf[0x10 + 1];
+			if (size > 0x100)
+				print_hex(addr >> 8);
+			else
+				puts("  ");
+			print_hex(addr & 0xff);
 			puts("  ");
 			for (i = addr, j = addr + 8; i < j; ++i) {
 				unsigned char c = avr_eeprom_read(i);
@@ -204,14 +669,74 @@ static __bit eval_eeprom(const char *args, unsigned char len)
 			putchar('\n');
 			return 0;
 		}
-	value = strtoh(args, &args);
-	if (*args && !IS_WHITESPACE(*args))
-		puts("eeprom: error parsing byte value\n");
-	else
-		avr_eeprom_write(addr, value);
+	for (len = 0; len < sizeof data; ++len) {
+		data[len] = strtoh(args, &end);
+		if (end == args)
+			break;
+		args = end;
+	}
+	for (; *args; ++args)
+		if (!IS_WHITESPACE(*args)) {
+			puts("eeprom: error parsing byte value\n");
+			return 0;
+		}
+	mask = avr_device->eeprom_page - 1;
+	for (i = 0; i < len; ++addr) {
+		if (!mask) {  /* byte writes only */
+			avr_eeprom_write(addr, data[i++]);
+			continue;
+		}
+		avr_eeprom_load(addr, data[i++]);
+		if ((addr & mask) == mask || i == len)
+			avr_eeprom_write_page(addr);
+	}
+	return 0;
+}
+
+/* print the parameters the part was identified by: its signature (or zeroes if
+ * it was not recognized), flash size, page size, EEPROM size, EEPROM page size
+ * and the flash, EEPROM and chip erase write delays in units of 100 us; then the
+ * SCK rate negotiated by "reset prog", from 0 for the fastest */
+static __bit eval_device(const char *args, unsigned char len)
+{
+	unsigned char i;
+	(void)args;
+	(void)len;
+	if (!avr_is_programming_enabled()) {
+		puts("device: device is not in serial programming mode;"
+				" use \"reset prog\"\n");
+		return 0;
+	}
+	for (i = 0; i < 3; ++i)
+		print_hex(avr_device->signature[i]);
+	putchar(' ');
+	print_hex(avr_device->flash_size >> 8);
+	print_hex(avr_device->flash_size & 0xff);
+	putchar(' ');
+	print_hex(avr_device->flash_page);
+	putchar(' ');
+	print_hex(avr_device->eeprom_size >> 8);
+	print_hex(avr_device->eeprom_size & 0xff);
+	putchar(' ');
+	print_hex(avr_device->eeprom_page);
+	putchar(' ');
+	print_hex(avr_device->t_wd_flash);
+	putchar(' ');
+	print_hex(avr_device->t_wd_eeprom);
+	putchar(' ');
+	print_hex(avr_device->t_wd_erase);
+	putchar(' ');
+	print_hex(avr_sck());
+	putchar('\n');
 	return 0;
 }
 
+/* in machine mode (see eval_mode()), nothing that is received is echoed or
+ * can be edited, and there are no prompts: an Intel HEX record is answered by
+ * its status character alone, and a command by its output and then ".\n", or
+ * "?\n" if it was not recognized or not used right */
+static __bit machine;
+
 static __bit eval_erase(const char *args, unsigned char len)
 {
 	char c;
@@ -222,11 +747,14 @@ static __bit eval_erase(const char *args, unsigned char len)
 				" use \"reset prog\"\n");
 		return 0;
 	}
-	puts("This will erase all program memory and EEPROM!!"
-			"  Are you sure? [y/N]: ");
+	if (!machine)
+		puts("This will erase all program memory and EEPROM!!"
+				"  Are you sure? [y/N]: ");
 	while (c = getchar(), IS_WHITESPACE(c) && c != '\r');
-	putchar(c);
-	putchar('\n');
+	if (!machine) {
+		putchar(c);
+		putchar('\n');
+	}
 	if (c == 'y' || c == 'Y')
 		avr_erase();
 	else
@@ -240,7 +768,7 @@ static __bit eval_flash_read(unsigned short addr)
 	print_hex(addr >> 8);
 	print_hex(addr & 0xff);
 	putchar(' ');
-	for (stop = addr + 0x20; addr < stop; ++addr)
+	for (stop = addr + page_size(); addr < stop; ++addr)
 		print_hex(avr_flash_read(addr));
 	putchar('\n');
 	return 0;
@@ -249,7 +777,7 @@ static __bit eval_flash_read(unsigned short addr)
 static __bit eval_flash_write(const char *args, unsigned char len,
 		unsigned short addr)
 {
-	unsigned char i, data[0x20];
+	unsigned char data[0x20];
 	if (!len)
 		return 1;
 	for (len = 0; len < sizeof data; ++len) {
@@ -264,10 +792,9 @@ static __bit eval_flash_write(const char *args, unsigned char len,
 	}
 	if (!len || *args && !IS_WHITESPACE(*args))
 		goto error_parse;
-	for (i = 0; i < len; ++i)
-		avr_flash_load(addr + i, data[i]);
-	if (i % 2)  /* always write a complete word */
-		avr_flash_load(addr + i, 0xff);
+	if (len % 2)  /* always write a complete word */
+		data[len++] = 0xff;
+	avr_flash_load_page(addr, data, len);
 	avr_flash_write(addr);
 	if (0) {
 error_parse:
@@ -285,7 +812,7 @@ static __bit eval_flash(const char *args, unsigned char len)
 	addr = strtoh(args, &end);
 	if (end == args || !IS_WHITESPACE(*end))
 		return 1;
-	if (addr & 0x1f) {
+	if (addr & page_size() - 1) {
 		puts("flash: ");
 		print_hex(addr >> 8);
 		print_hex(addr & 0xff);
@@ -303,9 +830,38 @@ static __bit eval_flash(const char *args, unsigned char len)
 	return eval_flash_write(end, args + len - end, addr);
 }
 
+#ifdef GANG
+/* with a mask of targets in hexadecimal, choose which to program from now on;
+ * otherwise print the mask of those still in the gang, then a status character
+ * for each target from 0 up (see AVR_GANG_OK in avr.h) */
+static __bit eval_gang(const char *args, unsigned char len)
+{
+	unsigned char t, mask = 0;
+	if (len) {
+		const char *end;
+		short n = strtoh(args, &end);
+		if (end == args || *end || n < 0 || n >= 1 << GANG)
+			return 1;
+		avr_gang_select(n);
+		return 0;
+	}
+	for (t = 0; t < GANG; ++t)
+		if (avr_gang_status(t) == AVR_GANG_OK)
+			mask |= 1 << t;
+	print_hex(mask);
+	putchar(' ');
+	for (t = 0; t < GANG; ++t)
+		putchar(avr_gang_status(t));
+	putchar('\n');
+	return 0;
+}
+#endif
+
 static __bit eval_hexdump(const char *args, unsigned char len)
 {
-	short start, count, addr, stop;
+	short start, count;
+	unsigned short addr, stop, size = avr_device->flash_size;
+	unsigned short mask = page_size() - 1;
 	if (!avr_is_programming_enabled()) {
 		puts("hexdump: device is not in serial programming mode;"
 				" use \"reset prog\"\n");
@@ -327,7 +883,7 @@ static __bit eval_hexdump(const char *args, unsigned char len)
 start_default:
 		start = 0;
 	} else if (start < 0) {
-		start += 0x800;
+		start += size;
 	}
 	if (!len) {
 		goto count_default;
@@ -341,24 +897,24 @@ start_default:
 	}
 	if (0) {
 count_default:
-		count = 0x800 - start;
+		count = size - start;
 	} else if (count < 0) {
 		start += count;
 		count = -count;
 	}
-	stop = start + count;
-	if (stop > 0x800)
-		stop = 0x800;
-	addr = start & ~0x1f;  /* floor to the nearest page boundary */
-	count = (stop + 0x1f) & ~0x1f;  /* ceil to the nearest page boundary */
-	for (; addr < count; addr += 0x10) {
+	stop = (unsigned short)start + count;
+	if (stop > size)
+		stop = size;
+	addr = start & ~mask;  /* floor to the nearest page boundary */
+	size = stop + mask & ~mask;  /* ceil to the nearest page boundary */
+	for (; addr < size; addr += 0x10) {
 		unsigned short i, j;
 		char buf[0x10 + 1];
 		print_hex(addr >> 8);
 		print_hex(addr & 0xff);
 		puts("  ");
 		for (i = addr, j = addr + 8; i < j; ++i) {
-			if (i < start || stop <= i) {
+			if (i < (unsigned short)start || stop <= i) {
 				puts("   ");
 				buf[i - addr] = ' ';
 			} else {
@@ -371,7 +927,7 @@ count_default:
 		}
 		putchar(' ');
 		for (j += 8; i < j; ++i) {
-			if (i < start || stop <= i) {
+			if (i < (unsigned short)start || stop <= i) {
 				puts("   ");
 				buf[i - addr] = ' ';
 			} else {
@@ -390,6 +946,61 @@ count_default:
 	return 0;
 }
 
+/* switch between the interactive REPL and machine mode, or print which it is */
+static __bit eval_mode(const char *args, unsigned char len)
+{
+	if (!len) {
+		puts(machine ? "machine\n" : "human\n");
+	} else if (len == 7 && !strncmp(args, "machine", 7)) {
+		machine = 1;
+	} else if (len == 5 && !strncmp(args, "human", 5)) {
+		machine = 0;
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
+/* stream a range of program memory or EEPROM as raw bytes, followed by a
+ * big-endian CRC-16 of them */
+static __bit eval_read(const char *args, unsigned char len)
+{
+	const char *end;
+	unsigned short addr, count, crc = 0xffff;
+	__bit eeprom;
+	if (!len)
+		return 1;
+	if (!strncmp(args, "eeprom", 6) && IS_WHITESPACE(args[6])) {
+		eeprom = 1;
+		args += 6;
+	} else if (!strncmp(args, "flash", 5) && IS_WHITESPACE(args[5])) {
+		eeprom = 0;
+		args += 5;
+	} else {
+		return 1;
+	}
+	addr = strtoh(args, &end);
+	if (end == args || !IS_WHITESPACE(*end))
+		return 1;
+	count = strtoh(end, &args);
+	if (args == end || *args && !IS_WHITESPACE(*args))
+		return 1;
+	if (!avr_is_programming_enabled()) {
+		puts("read: device is not in serial programming mode;"
+				" use \"reset prog\"\n");
+		return 0;
+	}
+	for (; count; --count, ++addr) {
+		unsigned char c = eeprom ? avr_eeprom_read(addr)
+			: avr_flash_read(addr);
+		crc = crc16(crc, c);
+		stdio_tx(c);
+	}
+	stdio_tx(crc >> 8);
+	stdio_tx(crc & 0xff);
+	return 0;
+}
+
 static __bit eval_reset(const char *args, unsigned char len)
 {
 	if (!len)
@@ -398,6 +1009,10 @@ static __bit eval_reset(const char *args, unsigned char len)
 		return 1;
 	else if (avr_programming_enable())
 		puts("reset: failed to initialize AVR serial programming mode\n");
+	else {  /* the page size may have changed; drop any partial page */
+		ihex_page = 0xffff;
+		ihex_eeprom = 0;
+	}
 	return 0;
 }
 
@@ -445,6 +1060,371 @@ error_parse:
 	return 0;
 }
 
+/* choose how the end of a write cycle is detected (see avr_set_wait()), or
+ * print the current choice and, for each kind of write cycle since it was made,
+ * how many there were, how many instructions were sent to see if they were
+ * done, and how long they took in total and at most, in units of 100 us */
+static __bit eval_wait(const char *args, unsigned char len)
+{
+	static const char *const modes[] = {"rdy", "data", "time"};
+	static const char *const ops[] = {"flash", "eeprom", "erase"};
+	unsigned char i;
+	if (len) {
+		for (i = 0; i < sizeof modes / sizeof *modes; ++i)
+			if (!strncmp(args, modes[i], len) && !modes[i][len]) {
+				avr_set_wait(i);
+				return 0;
+			}
+		return 1;
+	}
+	puts(modes[avr_get_wait()]);
+	putchar('\n');
+	for (i = 0; i < sizeof ops / sizeof *ops; ++i) {
+		const struct avr_wait_stats *stats = avr_wait_stats + i;
+		puts(ops[i]);
+		puts(" count ");
+		print_hex(stats->count >> 8);
+		print_hex(stats->count & 0xff);
+		puts(" polls ");
+		print_hex(stats->polls >> 8);
+		print_hex(stats->polls & 0xff);
+		puts(" ticks ");
+		print_hex(stats->ticks >> 8);
+		print_hex(stats->ticks & 0xff);
+		puts(" max ");
+		print_hex(stats->max >> 8);
+		print_hex(stats->max & 0xff);
+		putchar('\n');
+	}
+	return 0;
+}
+
+#ifdef PROFILE
+__xdata struct profile_slot profile[PROFILE_SLOTS];
+unsigned short profile_overhead;
+
+/* print each profile slot as "<name> <count> <total> <max>", in hex and in
+ * machine cycles, then clear them all */
+static __bit eval_profile(const char *args, unsigned char len)
+{
+	static const char *const names[PROFILE_SLOTS] = {"isr_rx", "isr_tx",
+		"masked", "getchar", "stdio_tx", "repl_char", "record", "ihex",
+		"spi_xfer", "spi_tx"};
+	struct profile_slot slot;
+	unsigned char i;
+	(void)args;
+	if (len)
+		return 1;
+	for (i = 0; i < PROFILE_SLOTS; ++i) {
+		ES = 0;  /* the serial interrupt updates some of them */
+		slot = profile[i];
+		profile[i].count = 0;
+		profile[i].total = 0;
+		profile[i].max = 0;
+		ES = 1;
+		puts(names[i]);
+		putchar(' ');
+		print_hex(slot.count >> 8);
+		print_hex(slot.count & 0xff);
+		putchar(' ');
+		print_hex(slot.total >> 24);
+		print_hex(slot.total >> 16 & 0xff);
+		print_hex(slot.total >> 8 & 0xff);
+		print_hex(slot.total & 0xff);
+		putchar(' ');
+		print_hex(slot.max >> 8);
+		print_hex(slot.max & 0xff);
+		putchar('\n');
+	}
+	puts("profile end\n");
+	return 0;
+}
+#endif
+
+/* print a counter as " <name> <value>", with the value in hexadecimal */
+static void print_stat(const char *name, unsigned long value,
+		unsigned char bytes)
+{
+	putchar(' ');
+	puts(name);
+	putchar(' ');
+	while (bytes--)
+		print_hex(value >> 8 * bytes & 0xff);
+}
+
+/* the units that "burn" passed and failed since power-on, and the image it
+ * burned last, which the button burns again */
+static unsigned short burn_passed, burn_failed;
+static unsigned char burn_image;
+
+/* return the ticks since the last call, timed by timer 1, which keeps count
+ * through the SPI transfers that timer 0's ticks go uncounted in */
+static unsigned long burn_last;
+static unsigned short burn_lap(void)
+{
+	unsigned long now = timer_cycles(), cycles = now - burn_last;
+	burn_last = now;
+	return cycles / TIMER_TICK_CYCLES;
+}
+
+/* feed the records of a stored image to ihex_apply(), straight from the store;
+ * return the status of the first that fails, or '.' */
+static char burn_records(unsigned short offset)
+{
+	const unsigned char *buf;
+	char status;
+	do {
+		buf = iap_ptr(IAP_STORE + offset);
+		offset += buf[0] + 4;
+		status = ihex_apply(buf, buf[0]);
+	} while (status == '.' && buf[3] != 1);
+	return status;
+}
+
+/* erase the AVR, program it with an image from the store, read it all back and
+ * let it run, at the fastest SCK rate it keeps up with and with no host; print
+ * a status character for the unit, or for each target in a gang (where those
+ * dropped from it show why, as for "gang"):
+ *  '.'  passed
+ *  'S'  failed to enter serial programming mode
+ *  'V'  read back differently from the image
+ * or the status from ihex_apply() of a record of the image that failed; then
+ * the ticks that entering programming mode, erasing, programming and verifying
+ * took, and the units passed and failed since power-on */
+static void burn(unsigned char n)
+{
+	unsigned short offset, ticks[4];
+	char status;
+#ifdef GANG
+	unsigned char t, mask = 0;
+#endif
+	store_scan();
+	offset = store_find(n);
+	if (offset == IAP_STORE_SIZE) {
+		puts("burn: no such image in the store\n");
+		return;
+	}
+	burn_image = n;
+#ifdef GANG
+	for (t = 0; t < GANG; ++t)  /* those chosen, new units in all of them */
+		if (avr_gang_status(t) != AVR_GANG_OFF)
+			mask |= 1 << t;
+	avr_gang_select(mask);
+#endif
+	burn_lap();
+	status = avr_programming_enable() ? 'S' : '.';
+	ihex_page = 0xffff;  /* as for "reset prog" */
+	ihex_eeprom = 0;
+	ticks[0] = burn_lap();
+	if (status == '.') {
+		avr_erase();
+		while (avr_busy());
+	}
+	ticks[1] = burn_lap();
+	if (status == '.') {
+		status = burn_records(offset);
+		while (ihex_poll() || avr_busy());
+	}
+	ticks[2] = burn_lap();
+	if (status == '.') {
+		ihex_verify = 1;
+		ihex_mismatches = 0;
+		status = burn_records(offset);
+		ihex_verify = 0;
+		if (status == '.' && ihex_mismatches)
+			status = 'V';
+	}
+	ticks[3] = burn_lap();
+	ihex_page = 0xffff;  /* anything left of an image that failed */
+	ihex_eeprom = 0;
+	avr_reset();
+	puts("burn ");
+#ifndef GANG
+	putchar(status);
+	if (status == '.')
+		++burn_passed;
+	else
+		++burn_failed;
+#else
+	for (t = 0; t < GANG; ++t) {
+		char c = avr_gang_status(t);
+		if (c == AVR_GANG_OK)
+			c = status;
+		putchar(c);
+		if (c == AVR_GANG_OK)
+			++burn_passed;
+		else if (c != AVR_GANG_OFF)
+			++burn_failed;
+	}
+#endif
+	print_stat("sync", ticks[0], 2);
+	print_stat("erase", ticks[1], 2);
+	print_stat("program", ticks[2], 2);
+	print_stat("verify", ticks[3], 2);
+	print_stat("passed", burn_passed, 2);
+	print_stat("failed", burn_failed, 2);
+	putchar('\n');
+}
+
+/* burn an image from the store, by default the one burned last */
+static __bit eval_burn(const char *args, unsigned char len)
+{
+	unsigned char n = burn_image;
+	if (len) {
+		const char *end;
+		short i = strtoh(args, &end);
+		if (end == args || *end || i < 0 || i > 0xff)
+			return 1;
+		n = i;
+	}
+	burn(n);
+	return 0;
+}
+
+/* burn the image burned last once the button has been held down for 20 ms, and
+ * not again until it has been let go for as long */
+static __bit button_down;
+static unsigned short button_since;  /* when it last read as debounced */
+static void burn_poll(void)
+{
+	unsigned short now = timer_ticks();
+	if (!BURN_BUTTON == button_down) {
+		button_since = now;
+		return;
+	}
+	if ((unsigned short)(now - button_since) < 20 * TIMER_TICKS_PER_MS)
+		return;
+	button_down = !button_down;
+	if (!button_down)
+		return;
+	if (!machine)  /* off the prompt, and back to it */
+		putchar('\n');
+	burn(burn_image);
+	if (!machine)
+		puts("> ");
+}
+
+/* print the counters kept since power-on, and those of the last packed upload,
+ * on one line as name/value pairs */
+static __bit eval_stats(const char *args, unsigned char len)
+{
+	struct stdio_stats uart;
+	(void)args;
+	if (len)
+		return 1;
+	ES = 0;  /* the serial interrupt updates these */
+	uart = stdio_stats;
+	ES = 1;
+	puts("stats");
+	print_stat("rx_overruns", uart.rx_overruns, 2);
+	print_stat("tx_stalls", uart.tx_stalls, 2);
+	print_stat("instructions", avr_stats.instructions, 4);
+	print_stat("writes", avr_stats.writes, 2);
+	print_stat("polls", avr_stats.polls, 4);
+	print_stat("retries", avr_stats.retries, 2);
+	print_stat("cache_hits", avr_stats.cache_hits, 4);
+	print_stat("cache_misses", avr_stats.cache_misses, 2);
+	print_stat("records", records, 2);
+	print_stat("packed_in", unpack_in, 2);
+	print_stat("packed_out", unpack_out, 2);
+	print_stat("packed_ticks", unpack_ticks, 4);
+	putchar('\n');
+	return 0;
+}
+
+/* with "add", keep the records that follow, in Intel HEX or binary frames, as
+ * another image up to its end-of-file record (see store_record()); with
+ * "clear", erase the store; otherwise print the number, offset and size of each
+ * image, then how many there are, the space left, and how much of it an image
+ * left incomplete takes, all in hexadecimal */
+static __bit eval_store(const char *args, unsigned char len)
+{
+	unsigned short offset, start;
+	unsigned char n;
+	storing = 0;
+	store_scan();
+	if (len == 3 && !strncmp(args, "add", 3)) {
+		if (store_last != store_end) {
+			puts("store: the last image is incomplete;"
+					" use \"store clear\"\n");
+			return 0;
+		}
+		storing = 1;
+		store_status = '.';
+		return 0;
+	}
+	if (len == 5 && !strncmp(args, "clear", 5)) {
+		/* up to the first blank sector past the end, as nothing is
+		 * ever written beyond that */
+		for (offset = 0; offset < IAP_STORE_SIZE; offset += IAP_SECTOR) {
+			unsigned char i = 0;
+			while (STORE(offset + i) == 0xff && ++i < IAP_SECTOR);
+			if (i == IAP_SECTOR) {
+				if (offset >= store_end)
+					break;
+			} else if (iap_erase_sector(IAP_STORE + offset)) {
+				puts("store: failed to erase ");
+				print_hex(IAP_STORE + offset >> 8);
+				print_hex(offset & 0xff);
+				putchar('\n');
+				return 0;
+			}
+		}
+		return 0;
+	}
+	if (len)
+		return 1;
+	for (offset = start = 0, n = 0; offset < store_last;) {
+		unsigned char type = STORE(offset + 3);
+		offset += STORE(offset) + 4;
+		if (type != 1)
+			continue;
+		print_hex(n++);
+		putchar(' ');
+		print_hex(start >> 8);
+		print_hex(start & 0xff);
+		putchar(' ');
+		print_hex(offset - start >> 8);
+		print_hex(offset - start & 0xff);
+		putchar('\n');
+		start = offset;
+	}
+	puts("store");
+	print_stat("images", store_images, 1);
+	print_stat("free", IAP_STORE_SIZE - store_end, 2);
+	print_stat("incomplete", store_end - store_last, 2);
+	putchar('\n');
+	return 0;
+}
+
+#ifdef TRACE
+/* print and forget the traced events, oldest first, as "<ticks> <type>
+ * <data>" in hexadecimal, then "trace end <count>" with the number of events
+ * that were lost to the ring filling up since the last time */
+static __bit eval_trace(const char *args, unsigned char len)
+{
+	struct trace_event event;
+	unsigned char i;
+	(void)args;
+	if (len)
+		return 1;
+	while (!trace_pop(&event)) {
+		print_hex(event.ticks >> 8);
+		print_hex(event.ticks & 0xff);
+		putchar(' ');
+		putchar(event.type);
+		putchar(' ');
+		for (i = 0; i < sizeof event.data; ++i)
+			print_hex(event.data[i]);
+		putchar('\n');
+	}
+	puts("trace end");
+	print_stat("lost", trace_lost(), 2);
+	putchar('\n');
+	return 0;
+}
+#endif
+
 static void usage(const char *prefix, const char *cmd, const char *args)
 {
 	if (prefix)
@@ -466,30 +1446,64 @@ static void eval(char *buf, unsigned char len)
 		__bit (*vector)(const char *, unsigned char);
 	} vectors[] = {
 #define VECTORS_ENTRY(cmd, args) {sizeof (#cmd) - 1, #cmd, args, eval_##cmd}
-		VECTORS_ENTRY(eeprom, "[<addr> [<value>]]"),
+		VECTORS_ENTRY(baud, "<rate>"),
+		VECTORS_ENTRY(binary, 0),
+		VECTORS_ENTRY(burn, "[<image>]"),
+		VECTORS_ENTRY(crc, "<addr> <count>"),
+		VECTORS_ENTRY(device, 0),
+		VECTORS_ENTRY(eeprom, "[<addr> [<value>...]]"),
 		VECTORS_ENTRY(erase, 0),
 		VECTORS_ENTRY(flash, "<addr> [<data>]"),
+#ifdef GANG
+		VECTORS_ENTRY(gang, "[<mask>]"),
+#endif
 		VECTORS_ENTRY(hexdump, "[<addr> [<count>]]"),
+		VECTORS_ENTRY(mode, "[human|machine]"),
+#ifdef PROFILE
+		VECTORS_ENTRY(profile, 0),
+#endif
+		VECTORS_ENTRY(read, "flash|eeprom <addr> <count>"),
 		VECTORS_ENTRY(reset, "[prog]"),
 		VECTORS_ENTRY(signature, 0),
 		VECTORS_ENTRY(spi, "<data>"),
+		VECTORS_ENTRY(stats, 0),
+		VECTORS_ENTRY(store, "[add|clear]"),
+#ifdef TRACE
+		VECTORS_ENTRY(trace, 0),
+#endif
+		VECTORS_ENTRY(wait, "[rdy|data|time]"),
 	};
 	unsigned char i, key_len;
+	while (ihex_poll());  /* commands see a completely written page */
 	for (key_len = 0; !IS_WHITESPACE(buf[key_len]); ++key_len);
 	for (i = 0; i < sizeof vectors / sizeof *vectors; ++i) {
 		if (key_len == vectors[i].len
 				&& !strncmp(buf, vectors[i].cmd, key_len)) {
+			unsigned char status;
+#ifdef TRACE
+			unsigned char event[5] = {0};
+			for (status = 0; status < 4 && status < key_len;
+					++status)
+				event[status] = buf[status];
+#endif
 			for (; buf[key_len]
 					&& IS_WHITESPACE(buf[key_len]);
 					++key_len);
-			if ((len > key_len
+			status = (len > key_len
 					&& !strncmp(buf + key_len, "help", 4)
 					&& IS_WHITESPACE(buf[key_len + 4]))
 					|| vectors[i].vector(buf + key_len,
-						len - key_len)) {
+						len - key_len);
+			if (machine) {  /* as it is after the command */
+				puts(status ? "?\n" : ".\n");
+			} else if (status) {
 				puts("usage: ");
 				usage(0, vectors[i].cmd, vectors[i].args);
 			}
+#ifdef TRACE
+			event[4] = status;
+			trace(TRACE_COMMAND, event);
+#endif
 			return;
 		}
 	}
@@ -498,6 +1512,10 @@ static void eval(char *buf, unsigned char len)
 				"available commands:\n");
 		for (i = 0; i < sizeof vectors / sizeof *vectors; ++i)
 			usage(" ", vectors[i].cmd, vectors[i].args);
+		if (machine)
+			puts(".\n");
+	} else if (machine) {
+		puts("?\n");
 	} else {
 		puts("invalid command \"");
 		buf[key_len] = '\0';
@@ -510,18 +1528,39 @@ void main(void)
 {
 	/* delay timer setup */
 	TMOD = T0_M1;  /* timer 0 in 8-bit auto-reload mode */
-	TH0 = -F_CPU / 12 / 4000;  /* 250-us timer */
+	TH0 = -TIMER_TICK_CYCLES;  /* 100-us timer, rounded up */
+	TR0 = 1;
+
+	/* timer 1 counts machine cycles for timer_cycles() */
+	TMOD |= T1_M0;  /* 16-bit mode */
+	TR1 = 1;
+
+#ifdef PROFILE
+	/* and for profile.h; measure what a START and a STOP cost on their own
+	 * so that it can be left out */
+	{
+		unsigned short t, e;
+		PROFILE_START(t);
+		PROFILE_READ(e);
+		profile_overhead = e - t;
+	}
+#endif
 
 	/* serial port setup */
 	SCON = SCON_SM1 | SCON_REN;  /* 8-bit UART mode, receive enabled */
 	RCAP2L = -F_CPU / 32 / F_UART;
 	RCAP2H = -F_CPU / 32 / F_UART >> 8;
-	IE = IE_EA | IE_ES0;  /* enable the serial interrupt */
+#ifdef FLOW_RTS
+	STDIO_RTS = 0;  /* ready to receive */
+#endif
+	IE = IE_EA | IE_ES0 | IE_ET1;  /* enable the serial and timer 1
+					 interrupts */
 	T2CON = T2CON_TF2 | T2CON_RCLK | T2CON_TCLK | T2CON_TR2;  /* start T2 */
 
 	/* SPI setup */
 #ifndef SPI_SW
-	SPCR = SPE | MSTR | SPR1;  /* SPI on, master mode, SCK = f(OSC) / 64 */
+	SPCR = SPE | MSTR | SPR1;  /* SPI on, master mode, SCK = f(OSC) / 64 until
+				     "reset prog" negotiates a rate */
 #else
 	P1_7 = 0;  /* SCK idles low */
 #endif
@@ -531,12 +1570,18 @@ void main(void)
 		static char buf[81];
 		char ptr = 0, ihex_len = 0;  /* in Intel HEX input mode? */
 		unsigned char len = 0xff;  /* ihex record data length */
-		puts("> ");
+		PROFILE_VAR(t);
+		PROFILE_VAR(u);
+		if (!machine)
+			puts("> ");
 		while (1) {
-			char c = getchar();
+			char c;
+			repl_idle = !ptr;
+			c = getchar_poll();
+			repl_idle = 0;
 			if (!ihex_len && c == '\r')
 				break;
-			if (c == 0x7f || c == 8) {
+			if ((c == 0x7f || c == 8) && !machine) {
 				if (!ptr)
 					continue;
 				--ptr;
@@ -548,11 +1593,13 @@ void main(void)
 				}
 				puts("\x8 \x8");
 			} else if (ihex_len) {
+				PROFILE_START(t);
 				if (parse_hex(c, buf + ptr)) {
 					putchar('X');
 					break;
 				}
-				putchar(c);
+				if (!machine)
+					putchar(c);
 				if (++ptr == 3) {
 					len = buf[1] * 0x10 + buf[2];
 					if (len > 0x10) {
@@ -565,22 +1612,31 @@ void main(void)
 					/* right now, buf[] is a string of hex
 					 * digits (like BCD, but in hex);
 					 * process it into raw values */
+					PROFILE_STOP(PROFILE_REPL_CHAR, t);
+					PROFILE_START(t);
 					for (ptr = 0; ptr < len + 5; ++ptr)
 						buf[ptr] = buf[1 + ptr * 2] * 0x10
 							+ buf[2 + ptr * 2];
-					putchar(ihex(buf, len));
+					PROFILE_START(u);
+					c = ihex(buf, len);
+					PROFILE_STOP(PROFILE_IHEX, u);
+					putchar(c);
+					PROFILE_STOP(PROFILE_RECORD, t);
 					break;
 				}
+				PROFILE_STOP(PROFILE_REPL_CHAR, t);
 			} else if (ptr < sizeof buf - 1) {
 				buf[ptr++] = c;
-				putchar(c);
+				if (!machine)
+					putchar(c);
 				if (c == ':' && ptr == 1) {
 					ihex_len = 0xff;
 					len = 0xff;
 				}
 			}
 		}
-		putchar('\n');
+		if (!machine)
+			putchar('\n');
 		if (!ihex_len) {
 			for (--ptr; ptr > 0 && IS_WHITESPACE(buf[ptr]); --ptr);
 			if (++ptr) {
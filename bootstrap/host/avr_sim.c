@@ -0,0 +1,298 @@
+/* behavioral model of AVR serial programming targets, clocked one bit at a
+ * time from the bootstrap's bit-banged SPI (see host_sck() in p89v51rd2.h);
+ * there is one target, or one per part given for a gang build (see avr.h) */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mcs51/p89v51rd2.h"
+#include "sim.h"
+
+#define AVR_MOSI P1_5
+#ifndef GANG
+#define GANG 1
+#define AVR_RESET(t) P1_0
+#define AVR_MISO(t, level) (P1_6 = (level))
+#else
+#define AVR_RESET(t) (P2 >> (4 + (t)) & 1)
+#define AVR_MISO(t, level) (P2 = (P2 & ~(1 << (t))) | (level) << (t))
+#endif
+
+static const struct part {
+	const char *name;
+	unsigned char sig[3];
+	unsigned flash, flash_page, eeprom, eeprom_page;
+	unsigned t_flash, t_eeprom, t_erase;  /* microseconds */
+} parts[] = {
+	{"attiny25", {0x1e, 0x91, 0x08}, 0x800, 0x20, 0x80, 4,
+		4500, 4000, 9000},
+	{"attiny45", {0x1e, 0x92, 0x06}, 0x1000, 0x40, 0x100, 4,
+		4500, 4000, 9000},
+	{"attiny85", {0x1e, 0x93, 0x0b}, 0x2000, 0x40, 0x200, 4,
+		4500, 4000, 9000},
+	{"atmega328p", {0x1e, 0x95, 0x0f}, 0x8000, 0x80, 0x400, 4,
+		2600, 3600, 9000},
+};
+
+static struct target {
+	const struct part *part;
+	unsigned char *flash, *eeprom, *page, *epage;
+	unsigned long epage_loaded;
+	int enabled, bit, pos;
+	unsigned char ins[4], in, out;
+	long long busy_until;
+} targets[GANG];
+static int ntargets;
+static struct {  /* of all the targets together */
+	unsigned long bytes, instructions, loads, writes, reads, polls,
+		 busy_polls, violations, erases, resets;
+} count;
+
+/* set up a target for each of a comma-separated list of parts */
+int avr_sim_init(const char *names, const char *image)
+{
+	char *list = strdup(names), *name, *save;
+	for (name = strtok_r(list, ",", &save); name;
+			name = strtok_r(0, ",", &save)) {
+		struct target *t = targets + ntargets;
+		unsigned i;
+		if (ntargets == GANG) {
+			fprintf(stderr, "at most %d part(s) in this build\n",
+					GANG);
+			return 1;
+		}
+		for (i = 0; i < sizeof parts / sizeof *parts; ++i)
+			if (!strcmp(parts[i].name, name))
+				t->part = parts + i;
+		if (!t->part) {
+			fprintf(stderr, "unknown part \"%s\"\n", name);
+			return 1;
+		}
+		t->flash = malloc(t->part->flash);
+		t->eeprom = malloc(t->part->eeprom);
+		t->page = malloc(t->part->flash_page);
+		t->epage = malloc(t->part->eeprom_page);
+		memset(t->flash, 0xff, t->part->flash);
+		memset(t->eeprom, 0xff, t->part->eeprom);
+		memset(t->page, 0xff, t->part->flash_page);
+		if (image) {
+			int fd = open(image, O_RDONLY);
+			if (fd < 0 || read(fd, t->flash, t->part->flash) < 0) {
+				perror(image);
+				return 1;
+			}
+			if (read(fd, t->eeprom, t->part->eeprom) < 0)
+				perror(image);
+			close(fd);
+		}
+		++ntargets;
+	}
+	free(list);
+	return 0;
+}
+
+/* save the first target's memories to image, and any others' to image.<n> */
+void avr_sim_save(const char *image)
+{
+	int i;
+	for (i = 0; i < ntargets; ++i) {
+		const struct target *t = targets + i;
+		char *name;
+		int fd;
+		if (i ? asprintf(&name, "%s.%d", image, i) < 0
+				: !(name = strdup(image)))
+			return;
+		fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, t->flash, t->part->flash) < 0
+				|| write(fd, t->eeprom, t->part->eeprom) < 0)
+			perror(name);
+		close(fd);
+		free(name);
+	}
+}
+
+void avr_sim_report(int fd)
+{
+	dprintf(fd, "spi bytes %lu instructions %lu loads %lu writes %lu"
+			" reads %lu polls %lu (busy %lu) erases %lu resets %lu"
+			" violations %lu\n", count.bytes, count.instructions,
+			count.loads, count.writes, count.reads, count.polls,
+			count.busy_polls, count.erases, count.resets,
+			count.violations);
+}
+
+void avr_sim_tick(long long now)
+{
+	int i;
+	(void)now;
+	for (i = 0; i < ntargets; ++i) {
+		struct target *t = targets + i;
+		if (AVR_RESET(i)) {  /* running: leave programming mode */
+			if (t->enabled)
+				++count.resets;
+			t->enabled = 0;
+			t->bit = t->pos = 0;
+		}
+	}
+}
+
+static int busy(const struct target *t)
+{
+	return host_now() < t->busy_until;
+}
+
+static void set_busy(struct target *t, unsigned us)
+{
+	t->busy_until = host_now() + us * 1000ll;
+}
+
+/* the byte shifted out while the pos'th byte of an instruction shifts in */
+static unsigned char response(struct target *t)
+{
+	const struct part *part = t->part;
+	unsigned char *ins = t->ins;
+	unsigned addr = ins[1] << 8 | ins[2];
+	if (t->pos < 3)
+		return t->pos ? ins[t->pos - 1] : 0;
+	if (!t->enabled)
+		return ins[2];
+	switch (ins[0]) {
+	case 0x30:
+		return (ins[2] & 3) < 3 ? part->sig[ins[2] & 3] : 0xff;
+	case 0x20:
+	case 0x28:
+		++count.reads;
+		if (busy(t))
+			return 0xff;
+		return t->flash[(addr * 2 + (ins[0] == 0x28)) % part->flash];
+	case 0xa0:
+		++count.reads;
+		if (busy(t))
+			return 0xff;
+		return t->eeprom[addr % part->eeprom];
+	case 0xf0:
+		++count.polls;
+		if (busy(t)) {
+			++count.busy_polls;
+			return 1;
+		}
+		return 0;
+	case 0x50:
+	case 0x58:
+		return 0x62;
+	}
+	return ins[2];
+}
+
+static void execute(struct target *t)
+{
+	const struct part *part = t->part;
+	unsigned char *ins = t->ins;
+	unsigned addr = ins[1] << 8 | ins[2], i;
+	++count.instructions;
+	if (ins[0] == 0xac && ins[1] == 0x53) {
+		static long ignore = -1;
+		if (ignore < 0)
+			ignore = getenv("SIM_SYNC_AFTER") ?
+				atol(getenv("SIM_SYNC_AFTER")) : 0;
+		if (ignore && t == targets + ntargets - 1) {
+			/* SIM_SYNC_AFTER, for the last target; see host.c */
+			--ignore;
+			return;
+		}
+		t->enabled = 1;
+		return;
+	}
+	if (!t->enabled)
+		return;
+	switch (ins[0]) {
+	case 0x30:
+	case 0x20:
+	case 0x28:
+	case 0xa0:
+	case 0xf0:
+	case 0x50:
+	case 0x58:
+		return;
+	}
+	if (busy(t)) {
+		++count.violations;
+		return;
+	}
+	switch (ins[0]) {
+	case 0xac:
+		if (ins[1] == 0x80) {
+			++count.erases;
+			memset(t->flash, 0xff, part->flash);
+			memset(t->eeprom, 0xff, part->eeprom);
+			set_busy(t, part->t_erase);
+		}
+		break;
+	case 0x40:
+	case 0x48:
+		++count.loads;
+		t->page[(addr * 2 + (ins[0] == 0x48)) % part->flash_page]
+			= ins[3];
+		break;
+	case 0x4c:
+		++count.writes;
+		addr = addr * 2 % part->flash & ~(part->flash_page - 1);
+		for (i = 0; i < part->flash_page; ++i)
+			t->flash[addr + i] &= t->page[i];
+		memset(t->page, 0xff, part->flash_page);
+		set_busy(t, part->t_flash);
+		break;
+	case 0xc0:
+		++count.writes;
+		t->eeprom[addr % part->eeprom] = ins[3];
+		set_busy(t, part->t_eeprom);
+		break;
+	case 0xc1:
+		++count.loads;
+		t->epage[addr % part->eeprom_page] = ins[3];
+		t->epage_loaded |= 1ul << addr % part->eeprom_page;
+		break;
+	case 0xc2:
+		++count.writes;
+		addr = addr % part->eeprom & ~(part->eeprom_page - 1);
+		for (i = 0; i < part->eeprom_page; ++i)
+			if (t->epage_loaded & 1ul << i)
+				t->eeprom[addr + i] = t->epage[i];
+		t->epage_loaded = 0;
+		set_busy(t, part->t_eeprom);
+		break;
+	}
+}
+
+/* SPI mode 0: MOSI is sampled on the rising edge of SCK, and MISO changes on
+ * the falling edge; since the level written to SCK is only seen on the next
+ * access, both happen when a high level is found */
+volatile bool *host_sck(void)
+{
+	static volatile bool sck;
+	int i;
+	for (i = 0; i < ntargets; ++i) {
+		struct target *t = targets + i;
+		if (AVR_RESET(i)) {
+			t->bit = t->pos = 0;
+			t->out = 0xff;
+		} else if (sck) {
+			t->in = t->in << 1 | AVR_MOSI;
+			if (++t->bit == 8) {
+				t->bit = 0;
+				++count.bytes;
+				t->ins[t->pos] = t->in;
+				if (++t->pos == 4) {
+					t->pos = 0;
+					execute(t);
+				}
+				t->out = response(t);
+			}
+			AVR_MISO(i, t->out >> (7 - t->bit) & 1);
+		}
+	}
+	return &sck;
+}
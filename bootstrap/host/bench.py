@@ -0,0 +1,124 @@
+#!/usr/bin/env python
+"""Benchmark prog.py against the host-native build of the bootstrap.
+
+Each case starts a fresh simulator (bootstrap-host, from "make host"), flashes a
+reference image through prog.py's avr class, reads it back to check it, and
+reports the wall time of each phase, the upload rate, and how many SPI
+instructions the simulated AVR saw per KB of image."""
+import argparse, os, random, re, signal, subprocess, sys, tempfile, time
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(here, "..", ".."))
+import prog
+
+
+def image(size, seed, fill = 1.0):
+    """random data in the first fill of size bytes, and blank after that"""
+    rng = random.Random(seed)
+    used = int(size * fill)
+    return bytes(rng.randrange(0x100) for i in range(used))\
+            + b"\xff" * (size - used)
+
+
+def records(data):
+    recs = [prog.record(addr = a, data = list(data[a:a + 0x10]))
+            for a in range(0, len(data), 0x10)
+            if data[a:a + 0x10] != b"\xff" * len(data[a:a + 0x10])]
+    recs.append(prog.record(rec_type = prog.record_type.end_of_file))
+    return recs
+
+
+class simulator(object):
+    def __init__(self, binary, part, initial = None):
+        args = [binary, "-p", part]
+        self.initial = None
+        if initial is not None:
+            f = tempfile.NamedTemporaryFile(delete = False)
+            f.write(initial)
+            f.close()
+            self.initial = f.name
+            args += ["-i", f.name]
+        self.proc = subprocess.Popen(args, stdout = subprocess.PIPE,
+                stderr = subprocess.PIPE)
+        self.tty = self.proc.stdout.readline().decode().strip()
+
+    def stats(self):
+        """return the simulator's statistics so far"""
+        self.proc.send_signal(signal.SIGUSR1)
+        err = b"".join(self.proc.stderr.readline()
+                for i in range(3))  # uart, avr and iap lines
+        return {k: int(v) for k, v in re.findall(rb"(\w+) (\d+)", err)}
+
+    def stop(self):
+        """stop the simulator and return its statistics"""
+        self.proc.send_signal(signal.SIGTERM)
+        out, err = self.proc.communicate()
+        if self.initial is not None:
+            os.unlink(self.initial)
+        return {k: int(v) for k, v in re.findall(rb"(\w+) (\d+)", err)}
+
+
+def run(args, name, data, options, initial = None):
+    sim = simulator(args.binary, args.part, initial)
+    phases = []
+    try:
+        t = time.time()
+        targ = prog.avr(sim.tty, **options)
+        phases.append(("connect", time.time() - t))
+        before = sim.stats()
+        t = time.time()
+        targ.send_hex(records(data))
+        write = time.time() - t
+        phases.append(("write", write))
+        after = sim.stats()
+        t = time.time()
+        targ.command(b"reset prog")  # the write finished with a reset
+        readback = targ.read_memory(b"flash", 0, len(data))
+        phases.append(("verify", time.time() - t))
+        t = time.time()
+        targ.close()
+        phases.append(("close", time.time() - t))
+        os.close(targ.tty)
+    finally:
+        sim.stop()
+    ok = readback == data
+    kb = len(data) / 1024
+    print("%-12s %s %6.0f B/s %8.0f SPI/KB  %s" % (name,
+            "ok  " if ok else "FAIL", len(data) / write,
+            (after[b"instructions"] - before[b"instructions"]) / kb,
+            "  ".join("%s %.2fs" % p for p in phases)))
+    return ok
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description = __doc__)
+    parser.add_argument("-b", "--binary",
+            default = os.path.join(here, "..", "bootstrap-host"),
+            help = "simulator to run (default: ../bootstrap-host)",
+    )
+    parser.add_argument("-p", "--part",
+            default = "attiny25",
+            help = "simulated AVR (see parts[] in avr_sim.c)",
+    )
+    parser.add_argument("-s", "--size",
+            default = 0x800,
+            type = lambda x: int(x, 0),
+            help = "reference image size in bytes",
+    )
+    args = parser.parse_args()
+    full = image(args.size, 1)
+    half = image(args.size, 2, 0.5)
+    patched = bytearray(full)
+    patched[len(patched) // 3] &= 0x0f  # clears bits only: no erase needed
+    cases = (
+        ("ascii", full, {"baud": 19200}),
+        ("binary", full, {"baud": 19200, "binary": True}),
+        ("binary-fast", full, {"binary": True}),
+        ("half-image", half, {"binary": True}),
+        ("incremental", bytes(patched), {"binary": True,
+            "incremental": True}, full),
+    )
+    ok = True
+    for case in cases:
+        ok &= run(args, *case)
+    sys.exit(0 if ok else 1)
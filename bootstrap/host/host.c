@@ -0,0 +1,334 @@
+/* host-native harness for the bootstrap: the firmware's main() runs on the
+ * process's main thread, and a periodic SIGALRM plays the part of the 8051
+ * peripherals, clocking timers 0 and 1, shifting bytes in and out of a
+ * pseudo-terminal at the baud rate loaded into timer 2, and vectoring into
+ * stdio_isr(); the AVR at the other end of the bit-banged SPI is modeled in
+ * avr_sim.c
+ *
+ * the pseudo-terminal's name is printed on startup (and linked to with -l), so
+ * that prog.py can be pointed at it; on SIGINT or SIGTERM, the UART and AVR
+ * statistics are printed to stderr, and the AVR's memories saved with -o;
+ * SIGUSR1 prints the statistics and carries on; the P89V51RD2's own flash, with
+ * the store of images for "burn", is kept in a file with -f, and SIGUSR2
+ * presses the burn button (P3.2) for 50 ms
+ *
+ * for testing error handling, SIM_CORRUPT=<n> in the environment flips a bit
+ * in every n'th byte received, and SIM_SYNC_AFTER=<n> makes the AVR ignore the
+ * first n programming enable instructions, as if SCK were too fast for it
+ *
+ * built with receive flow control (see stdio.h), the simulated link stops
+ * delivering what the host sent on XOFF or while STDIO_RTS is high, as the
+ * host's UART would */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mcs51/p89v51rd2.h"
+#include "sim.h"
+
+volatile unsigned char TMOD, TL0, TH0, TL1, TH1;
+volatile bool TR0, TF0, TR1, TF1;
+volatile unsigned char SCON, T2CON, RCAP2L, RCAP2H, IE;
+volatile bool RI, TI, ES, ET1, EA;
+volatile unsigned char SPCR, SPSR, SPDAT;
+volatile unsigned char P1 = 0xff, P2 = 0xff, P3 = 0xff;
+volatile bool P1_0 = 1, P1_1 = 1, P1_2 = 1, P1_3 = 1, P1_4 = 1, P1_5 = 1,
+	 P1_6 = 1;
+volatile bool P3_2 = 1, P3_3 = 1, P3_4 = 1, P3_5 = 1;
+
+#define SBUF_IDLE 0x1000  /* nothing written since the last tick */
+#define SBUF_RX 0x2000  /* tags a received byte */
+volatile int SBUF = SBUF_IDLE;
+
+void stdio_isr(void);
+void timer1_isr(void);
+void firmware_main(void);
+
+#define TICK_US 20
+#define T2CON_TR2 0x04
+
+static int master = -1, slave = -1;
+static const char *save_image;
+static unsigned long corrupt;
+static struct {
+	long long rx_next, tx_done;
+	unsigned long rx_bytes, tx_bytes, overruns;
+	int tx_pend, tx_busy;
+	int held;  /* by XOFF */
+	unsigned char rx_hold, tx_byte;
+} uart;
+static struct {
+	int running;
+	long long next;
+} t0;
+static long long t1_start;
+static unsigned long long t1_overflows;
+static volatile long long button_up;  /* when to release the burn button */
+
+long long host_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+/* nanoseconds per UART character (start + 8 data + stop) */
+static long long uart_char_ns(void)
+{
+	unsigned short reload = RCAP2H << 8 | RCAP2L;
+	long long n = 0x10000 - reload;
+	return 10 * 1000000000ll * 32 * n / F_CPU;
+}
+
+/* latch whatever the firmware wrote to SBUF since the last look */
+static void uart_latch(void)
+{
+	if (SBUF < SBUF_IDLE) {
+		uart.tx_pend = 1;
+		uart.tx_byte = SBUF;
+		SBUF = SBUF_IDLE;
+	}
+}
+
+static void uart_tick(long long now)
+{
+	long long char_ns;
+	if (!(T2CON & T2CON_TR2))
+		return;
+	char_ns = uart_char_ns();
+	uart_latch();
+	if (uart.tx_busy && now >= uart.tx_done) {
+		unsigned char c = uart.tx_byte;
+		if (write(master, &c, 1) == 1 || errno != EAGAIN) {
+			uart.tx_busy = 0;
+			++uart.tx_bytes;
+			TI = 1;
+#ifdef FLOW_XONXOFF
+			/* the pty would only stop the host writing to it,
+			 * while anything already written can still be read,
+			 * so act as the host's UART and stop delivering; but
+			 * only while the host has IXON, as it does not for raw
+			 * data */
+			if (c == 0x13 || c == 0x11) {
+				struct termios attr;
+				if (!tcgetattr(slave, &attr)
+						&& attr.c_iflag & IXON)
+					uart.held = c == 0x13;
+			}
+#endif
+		}
+	}
+	if (!uart.tx_busy && uart.tx_pend) {
+		uart.tx_pend = 0;
+		uart.tx_busy = 1;
+		uart.tx_done = now + char_ns;
+	}
+#ifdef FLOW_RTS
+	uart.held = P1_2;  /* STDIO_RTS; the host holds off while it is high */
+#endif
+	if (uart.held)
+		return;
+	if (now >= uart.rx_next) {
+		unsigned char c;
+		if (read(master, &c, 1) == 1) {
+			if (corrupt && uart.rx_bytes % corrupt == corrupt - 1)
+				c ^= 0x20;
+			if (RI) {
+				++uart.overruns;
+			} else {
+				uart.rx_hold = c;
+				RI = 1;
+			}
+			++uart.rx_bytes;
+			if (uart.rx_next < now - char_ns)
+				uart.rx_next = now;
+			uart.rx_next += char_ns;
+		}
+	}
+}
+
+static void timer_tick(long long now)
+{
+	if (TR0) {
+		long long period = (0x100 - TH0) * 12 * 1000000000ll / F_CPU;
+		if (!t0.running) {
+			t0.running = 1;
+			t0.next = now + period;
+		}
+		while (now >= t0.next) {
+			TF0 = 1;
+			t0.next += period;
+		}
+	} else {
+		t0.running = 0;
+	}
+	if (TR1) {
+		unsigned long long count;
+		if (!t1_start)
+			t1_start = now;
+		count = (now - t1_start) * (F_CPU / 12) / 1000000000ll;
+		TL1 = count;
+		TH1 = count >> 8;
+		if (count >> 16 != t1_overflows) {
+			t1_overflows = count >> 16;
+			TF1 = 1;
+		}
+	} else {
+		t1_start = 0;
+		t1_overflows = 0;
+	}
+}
+
+/* IE is bit-addressable, so firmware may write either the register or its EA,
+ * ES and ET1 bits; fold register writes into the bits */
+static void sync_ie(void)
+{
+	static unsigned char last;
+	if (IE != last) {
+		last = IE;
+		EA = IE & 0x80;
+		ES = IE & 0x10;
+		ET1 = IE & 0x08;
+	}
+}
+
+static void tick(int sig)
+{
+	long long now = host_now();
+	(void)sig;
+	sync_ie();
+	timer_tick(now);
+	uart_tick(now);
+	avr_sim_tick(now);
+	if (EA && ET1 && TF1) {
+		TF1 = 0;
+		timer1_isr();
+	}
+	if (button_up && now >= button_up) {
+		P3_2 = 1;
+		button_up = 0;
+	}
+	if (EA && ES && (RI || TI)) {
+		int rx = RI;
+		uart_latch();
+		if (rx)
+			SBUF = SBUF_RX | uart.rx_hold;
+		stdio_isr();
+		if (rx && SBUF >= SBUF_IDLE)
+			SBUF = SBUF_IDLE;
+		uart_latch();
+		if (!uart.tx_busy && uart.tx_pend) {
+			uart.tx_pend = 0;
+			uart.tx_busy = 1;
+			uart.tx_done = now + uart_char_ns();
+		}
+	}
+}
+
+static void report(int sig)
+{
+	dprintf(2, "uart rx %lu tx %lu overruns %lu\n", uart.rx_bytes,
+			uart.tx_bytes, uart.overruns);
+	avr_sim_report(2);
+	iap_sim_report(2);
+	if (sig == SIGUSR1)  /* just a look */
+		return;
+	if (save_image)
+		avr_sim_save(save_image);
+	iap_sim_save();
+	_exit(0);
+}
+
+static void press(int sig)
+{
+	(void)sig;
+	P3_2 = 0;
+	button_up = host_now() + 50000000;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-l <link>] [-p <part>[,<part>...]]"
+			" [-i <image>] [-o <image>] [-f <store>]\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *link = 0, *part = "attiny25", *image = 0, *store = 0;
+	struct itimerval it = {{0, TICK_US}, {0, TICK_US}};
+	struct sigaction sa;
+	struct termios attr;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:p:i:o:f:")) != -1)
+		switch (opt) {
+		case 'l':
+			link = optarg;
+			break;
+		case 'p':
+			part = optarg;
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 'o':
+			save_image = optarg;
+			break;
+		case 'f':
+			store = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	if (getenv("SIM_CORRUPT"))
+		corrupt = strtoul(getenv("SIM_CORRUPT"), 0, 0);
+	if (avr_sim_init(part, image) || iap_sim_init(store))
+		return 1;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (master < 0 || grantpt(master) || unlockpt(master)) {
+		perror("posix_openpt");
+		return 1;
+	}
+	/* keep the slave side open so reads don't fail between clients */
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &attr)) {
+		perror(ptsname(master));
+		return 1;
+	}
+	cfmakeraw(&attr);
+	tcsetattr(slave, TCSANOW, &attr);
+	if (link) {
+		unlink(link);
+		if (symlink(ptsname(master), link)) {
+			perror(link);
+			return 1;
+		}
+	}
+	printf("%s\n", ptsname(master));
+	fflush(stdout);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = report;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, 0);
+	sa.sa_handler = press;
+	sigaction(SIGUSR2, &sa, 0);
+	sa.sa_handler = tick;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &sa, 0);
+	setitimer(ITIMER_REAL, &it, 0);
+
+	firmware_main();
+	return 0;
+}
@@ -0,0 +1,75 @@
+/* model of the P89V51RD2's own flash above IAP_STORE, for iap.h in place of
+ * iap.c: programming can only clear bits, as on the chip, and with -f the
+ * store is kept in a file from one run to the next */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mcs51/p89v51rd2.h"
+#include "sim.h"
+#include "../iap.h"
+
+/* with room for a record header read past the end, which wraps on the chip */
+static unsigned char store[IAP_STORE_SIZE + 4];
+static const char *store_file;
+static unsigned long programs, erases;
+
+int iap_sim_init(const char *file)
+{
+	int fd;
+	memset(store, 0xff, sizeof store);
+	store_file = file;
+	if (!file)
+		return 0;
+	fd = open(file, O_RDONLY);
+	if (fd < 0 && errno == ENOENT)  /* a new one */
+		return 0;
+	if (fd < 0 || read(fd, store, IAP_STORE_SIZE) < 0) {
+		perror(file);
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+void iap_sim_save(void)
+{
+	int fd;
+	if (!store_file)
+		return;
+	fd = open(store_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, store, IAP_STORE_SIZE) < 0)
+		perror(store_file);
+	close(fd);
+}
+
+void iap_sim_report(int fd)
+{
+	dprintf(fd, "iap programs %lu erases %lu\n", programs, erases);
+}
+
+const unsigned char *iap_ptr(unsigned short addr)
+{
+	return store + (addr - IAP_STORE);  /* only ever the store */
+}
+
+bool iap_erase_sector(unsigned short addr)
+{
+	if (addr < IAP_STORE)  /* the bootstrap itself */
+		return 1;
+	memset(store + (addr - IAP_STORE & ~(IAP_SECTOR - 1)), 0xff,
+			IAP_SECTOR);
+	++erases;
+	return 0;
+}
+
+bool iap_program(unsigned short addr, unsigned char value)
+{
+	if (addr < IAP_STORE)
+		return 1;
+	store[addr - IAP_STORE] &= value;
+	++programs;
+	return store[addr - IAP_STORE] != value;
+}
@@ -0,0 +1,60 @@
+/* host shim for the SDCC P89V51RD2 register definitions: the special function
+ * registers become ordinary variables that host.c updates from a periodic
+ * signal handler, much the same way the peripherals would */
+#ifndef HOST_P89V51RD2_H
+#define HOST_P89V51RD2_H
+
+#include <stdbool.h>
+
+#define __bit bool
+#define __data
+#define __idata
+#define __xdata
+#define __pdata
+#define __code
+#define __at(x)
+#define __interrupt(x)
+#define __using(x)
+#define __critical
+
+#define TF1_VECTOR 3
+#define SI0_VECTOR 4
+
+/* timer/counter mode bits */
+#define T0_M0 0x01
+#define T0_M1 0x02
+#define T1_M0 0x10
+#define T1_M1 0x20
+
+/* SPI control and status bits */
+#define SPR0 0x01
+#define SPR1 0x02
+#define CPHA 0x04
+#define CPOL 0x08
+#define MSTR 0x10
+#define DORD 0x20
+#define SPE 0x40
+#define SPIE 0x80
+#define SPIF 0x80
+#define WCOL 0x40
+
+extern volatile unsigned char TMOD, TL0, TH0, TL1, TH1;
+extern volatile bool TR0, TF0, TR1, TF1;
+extern volatile unsigned char SCON, T2CON, RCAP2L, RCAP2H, IE;
+extern volatile bool RI, TI, ES, ET1, EA;
+extern volatile unsigned char SPCR, SPSR, SPDAT;
+extern volatile unsigned char P1, P2, P3;
+extern volatile bool P1_0, P1_1, P1_2, P1_3, P1_4, P1_5, P1_6;
+extern volatile bool P3_2, P3_3, P3_4, P3_5;
+
+/* SBUF is two registers behind one address: reads return the last received
+ * byte and writes start a transmission, so the simulator tags the receive side
+ * to tell them apart */
+extern volatile int SBUF;
+
+/* SCK is watched rather than stored: every access hands the simulated target
+ * the level written by the previous one, so it can shift on the edges */
+volatile bool *host_sck(void);
+#define P1_7 (*host_sck())
+
+#endif
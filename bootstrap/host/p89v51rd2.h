@@ -0,0 +1,2 @@
+/* for sources that include <p89v51rd2.h> directly */
+#include "mcs51/p89v51rd2.h"
@@ -0,0 +1,15 @@
+#ifndef SIM_H
+#define SIM_H
+
+long long host_now(void);
+
+int avr_sim_init(const char *part, const char *image);
+void avr_sim_tick(long long now);
+void avr_sim_report(int fd);
+void avr_sim_save(const char *image);
+
+int iap_sim_init(const char *file);
+void iap_sim_save(void);
+void iap_sim_report(int fd);
+
+#endif
@@ -0,0 +1,61 @@
+#include <p89v51rd2.h>
+
+#include "iap.h"
+
+/* the boot ROM's IAP entry point, PGM_MTP at 0x1ff0, is only there while
+ * FCF's BSEL bit is clear, which maps the boot ROM over the first 8 KB of user
+ * code, interrupt vectors and all; so this file is linked into a segment of its
+ * own above that (see LDFLAGS in the Makefile), and the calls are made with
+ * interrupts disabled, which holds the serial interrupt off for the tens of
+ * microseconds a byte takes to program, well under a character time */
+#pragma codeseg IAP
+
+#define IAP_PROGRAM 0x02  /* R1 values */
+#define IAP_ERASE_SECTOR 0x08
+
+static __data unsigned char iap_op, iap_value;
+static __data unsigned short iap_addr;
+
+/* call PGM_MTP with iap_op in R1, iap_addr in DPTR and iap_value in A; return
+ * what it leaves in A, which is zero on success */
+static unsigned char iap(void) __naked
+{
+	__asm
+	push	_IE
+	clr	_EA
+	anl	0xb1,#0xfe	; FCF: BSEL = 0, boot ROM in
+	mov	r1,_iap_op
+	mov	dpl,_iap_addr
+	mov	dph,(_iap_addr + 1)
+	mov	a,_iap_value
+	lcall	0x1ff0
+	orl	0xb1,#0x01	; FCF: BSEL = 1, user code back
+	pop	_IE
+	mov	dpl,a
+	ret
+	__endasm;
+}
+
+/* point to code memory */
+const unsigned char *iap_ptr(unsigned short addr)
+{
+	return (const __code unsigned char *)addr;
+}
+
+/* erase the sector an address is in; return zero on success, or non-zero on
+ * failure */
+__bit iap_erase_sector(unsigned short addr)
+{
+	iap_op = IAP_ERASE_SECTOR;
+	iap_addr = addr;
+	return iap() != 0;
+}
+
+/* program an erased byte; return zero on success, or non-zero on failure */
+__bit iap_program(unsigned short addr, unsigned char value)
+{
+	iap_op = IAP_PROGRAM;
+	iap_addr = addr;
+	iap_value = value;
+	return iap() != 0;
+}
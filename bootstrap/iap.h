@@ -0,0 +1,17 @@
+#ifndef IAP_H
+#define IAP_H
+
+/* the P89V51RD2's own flash from IAP_STORE up is not code (see LDFLAGS in the
+ * Makefile), but the store of target images that "burn" programs from; it is
+ * read in place, through a pointer to code memory, and erased a sector at a
+ * time and programmed a byte at a time through the in-application programming
+ * routines of the boot ROM */
+#define IAP_STORE 0x8000
+#define IAP_STORE_SIZE 0x8000
+#define IAP_SECTOR 0x80
+
+const unsigned char *iap_ptr(unsigned short);
+__bit iap_erase_sector(unsigned short);
+__bit iap_program(unsigned short, unsigned char);
+
+#endif
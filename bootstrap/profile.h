@@ -0,0 +1,55 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/* cycle counts of the hot paths, for profiling builds (-DPROFILE; see
+ * profile/profile.py): timer 1 counts machine cycles, and each slot collects
+ * how many times a path ran, for how many cycles in total, and at most */
+#define PROFILE_ISR_RX 0  /* stdio_isr(), receiving a byte */
+#define PROFILE_ISR_TX 1  /* stdio_isr(), transmitting a byte */
+#define PROFILE_MASKED 2  /* the serial interrupt disabled outside of it */
+#define PROFILE_GETCHAR 3
+#define PROFILE_STDIO_TX 4  /* not counting waits for room */
+#define PROFILE_REPL_CHAR 5  /* a character of an Intel HEX line */
+#define PROFILE_RECORD 6  /* a complete Intel HEX line, after the last char */
+#define PROFILE_IHEX 7
+#define PROFILE_SPI_XFER 8
+#define PROFILE_SPI_TX 9
+#define PROFILE_SLOTS 10
+
+#ifdef PROFILE
+struct profile_slot {
+	unsigned short count;
+	unsigned long total;
+	unsigned short max;
+};
+extern __xdata struct profile_slot profile[PROFILE_SLOTS];
+extern unsigned short profile_overhead;  /* of PROFILE_START/STOP themselves */
+
+/* these are macros rather than functions so that stdio_isr() can use them
+ * without having to save every register */
+#define PROFILE_READ(t) do { \
+	unsigned char h_; \
+	do { \
+		h_ = TH1; \
+		(t) = h_ << 8 | TL1; \
+	} while (h_ != TH1); \
+} while (0)
+#define PROFILE_VAR(t) unsigned short t
+#define PROFILE_START(t) PROFILE_READ(t)
+#define PROFILE_STOP(slot, t) do { \
+	unsigned short e_; \
+	PROFILE_READ(e_); \
+	e_ -= (t); \
+	e_ = e_ > profile_overhead ? e_ - profile_overhead : 0; \
+	++profile[slot].count; \
+	profile[slot].total += e_; \
+	if (profile[slot].max < e_) \
+		profile[slot].max = e_; \
+} while (0)
+#else
+#define PROFILE_VAR(t)
+#define PROFILE_START(t)
+#define PROFILE_STOP(slot, t)
+#endif
+
+#endif
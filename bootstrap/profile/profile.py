@@ -0,0 +1,173 @@
+#!/usr/bin/env python
+"""Profile a -DPROFILE build of the bootstrap on the SDCC 8051 simulator.
+
+The simulated UART is fed a session like the one prog.py holds in ASCII mode:
+"reset prog", then a reference image as Intel HEX, then "profile", which prints
+the cycle counts collected in profile.h's slots.  Nothing answers the SPI in the
+simulator, so the writes wait a fixed time ("wait time") and the hardware SPI's
+shift time is left out (see SPI_WAIT() in avr.c).
+
+The metrics, in machine cycles, are compared against profile/baseline-MODE.txt,
+which is only written with --update; the run fails if there is none, or if any
+of them got more than --tolerance worse."""
+import argparse, os, subprocess, sys, tempfile, time
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(here, "..", ".."))
+import prog
+
+# the longest 8051 instruction, plus the LCALL to the vector
+irq_entry = 4 + 2
+
+
+def session(size):
+    """the bytes sent to the simulated UART"""
+    data = [(a * 7 + (a >> 8)) & 0xff for a in range(size)]
+    out = [b"\r", b"wait time\r", b"reset prog\r"]
+    for a in range(0, size, 0x10):
+        rec = prog.record(addr = a, data = data[a:a + 0x10])
+        out.append(str(rec).encode() + b"\r")
+    out.append(str(prog.record(rec_type = prog.record_type.end_of_file))\
+            .encode() + b"\r")
+    out.append(b"profile\r")
+    return b"".join(out), size // 0x10
+
+
+def simulate(args, ihx, data):
+    """run s51 until the profile has been printed, and return what it sent"""
+    tmp = tempfile.mkdtemp()
+    inp = os.path.join(tmp, "in")
+    outp = os.path.join(tmp, "out")
+    with open(inp, "wb") as f:
+        f.write(data)
+    open(outp, "wb").close()
+    cmd = [args.s51, "-t", args.type, "-X", args.xtal,
+            "-S", "in=%s,out=%s" % (inp, outp), "-G", ihx]
+    proc = subprocess.Popen(cmd, stdin = subprocess.PIPE,
+            stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL)
+    deadline = time.time() + args.timeout
+    try:
+        while True:
+            with open(outp, "rb") as f:
+                out = f.read()
+            if b"profile end" in out:
+                return out
+            if proc.poll() is not None or time.time() > deadline:
+                sys.exit("%s: no profile after %ds" % (ihx, args.timeout))
+            time.sleep(0.5)
+    finally:
+        proc.kill()
+        proc.wait()
+        os.unlink(inp)
+        os.unlink(outp)
+        os.rmdir(tmp)
+
+
+def parse(out):
+    """return {slot: (count, total, max)} from the profile command's output"""
+    slots = {}
+    lines = out.decode("ascii", "replace").replace("\r", "").split("\n")
+    start = max(i for i, l in enumerate(lines) if l.endswith("> profile"))
+    for line in lines[start + 1:]:
+        if line == "profile end":
+            break
+        name, count, total, worst = line.split()
+        slots[name] = (int(count, 16), int(total, 16), int(worst, 16))
+    return slots
+
+
+def metrics(slots, records):
+    def per(name):
+        count, total, worst = slots[name]
+        return total / count if count else 0.0
+    return [
+        ("isr_rx_per_byte", per("isr_rx")),
+        ("isr_tx_per_byte", per("isr_tx")),
+        ("getchar_per_call", per("getchar")),
+        ("stdio_tx_per_call", per("stdio_tx")),
+        ("cycles_per_record", (slots["record"][1] + slots["repl_char"][1])
+                / records),
+        ("ihex_per_record", slots["ihex"][1] / records),
+        ("spi_xfer_per_byte", per("spi_xfer")),
+        ("spi_tx_per_byte", per("spi_tx")),
+        ("irq_latency_max", max(slots["masked"][2],
+                slots["isr_rx"][2] + slots["isr_tx"][2]) + irq_entry),
+    ]
+
+
+def load(path):
+    with open(path) as f:
+        return {name: float(value) for name, value in
+                (line.split() for line in f if line.strip())}
+
+
+def save(path, results):
+    with open(path, "w") as f:
+        for name, value in results:
+            f.write("%s %.1f\n" % (name, value))
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description = __doc__)
+    parser.add_argument("mode",
+            help = "baseline to compare against (sw or hw SPI)",
+    )
+    parser.add_argument("ihx",
+            help = "-DPROFILE build of the bootstrap",
+    )
+    parser.add_argument("--s51",
+            default = "s51",
+            help = "simulator to run",
+    )
+    parser.add_argument("--type",
+            default = "8052",
+            help = "s51 CPU type",
+    )
+    parser.add_argument("--xtal",
+            default = "4.9152M",
+            help = "s51 clock frequency, to match F_CPU",
+    )
+    parser.add_argument("-s", "--size",
+            default = 0x800,
+            type = lambda x: int(x, 0),
+            help = "reference image size in bytes",
+    )
+    parser.add_argument("--timeout",
+            default = 600,
+            type = int,
+            help = "seconds to wait for the simulator",
+    )
+    parser.add_argument("--tolerance",
+            default = 0.02,
+            type = float,
+            help = "fraction by which a metric may exceed its baseline",
+    )
+    parser.add_argument("--update",
+            action = "store_true",
+            help = "write the results as the new baseline",
+    )
+    args = parser.parse_args()
+    baseline_path = os.path.join(here, "baseline-%s.txt" % args.mode)
+    if not args.update and not os.path.exists(baseline_path):
+        sys.exit("%s: no baseline; run with --update to write one"
+                % baseline_path)
+    baseline = {} if args.update else load(baseline_path)
+    data, records = session(args.size)
+    results = metrics(parse(simulate(args, args.ihx, data)), records)
+    ok = True
+    for name, value in results:
+        line = "%-20s %10.1f" % (name, value)
+        if name in baseline:
+            base = baseline[name]
+            line += "  baseline %10.1f" % base
+            if value > base * (1 + args.tolerance):
+                line += "  REGRESSED"
+                ok = False
+        elif not args.update:
+            line += "  no baseline"
+            ok = False
+        print(line)
+    if args.update:
+        save(baseline_path, results)
+        print("wrote %s" % baseline_path)
+    sys.exit(0 if ok else 1)
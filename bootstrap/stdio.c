@@ -1,69 +1,171 @@
 #include <mcs51/p89v51rd2.h>
 
+#include "profile.h"
 #include "stdio.h"
 
-static __data unsigned char rx_rptr, rx_wptr;
-static __idata char rx_buf[BUFSIZ * 2];
-static __bit tx_idle = 1, tx_empty = 1;
-static __data unsigned char tx_rptr, tx_wptr;
-static __idata char tx_buf[BUFSIZ];
-void stdio_isr(void) __interrupt (SI0_VECTOR)
+/* the buffers are single-producer, single-consumer rings: each index is only
+ * ever advanced by one side, with a single INC, and runs freely through 256
+ * values while the buffer sizes are powers of two that divide that, so neither
+ * side has to disable the serial interrupt to hand a byte over
+ *
+ * the interrupt runs on register bank 1, so it only saves ACC and PSW; its
+ * worst case, estimated in machine cycles of 12 clocks (2.44 us at F_CPU) by
+ * counting the instructions SDCC should emit for it, not yet checked against a
+ * listing or against "make profile", which measures the real thing:
+ *  up to 9 to take the interrupt, plus 2 for the LCALL and 2 for the LJMP
+ *  6 to save ACC and PSW and switch banks, and 6 to restore them and return
+ *  2 to test each of RI and TI
+ *  22 more to receive a byte, 8 of them checking the flow control watermark,
+ *   and 6 more in the rare case that this sends XOFF
+ *  13 more to transmit the next byte, or XON/XOFF
+ * which comes to 42 cycles for a byte received and 33 for one transmitted, or 70
+ * for both in one go with XOFF and the worst latency; a byte takes 4096000 /
+ * baud cycles, so the interrupt keeps up with a steady stream of binary frames
+ * (42 a byte) up to 57600 baud (71 a byte), and with one that is echoed (75)
+ * up to 38400 (107), while 115200 (36) is only good for bursts */
+#define RX_SIZE (BUFSIZ * 2)
+#define TX_SIZE BUFSIZ
+#if RX_SIZE & (RX_SIZE - 1) || TX_SIZE & (TX_SIZE - 1) || RX_SIZE > 0x80
+#error the stdio buffer sizes must be powers of two up to 0x80
+#endif
+static volatile __data unsigned char rx_rptr, rx_wptr;
+static __idata char rx_buf[RX_SIZE];
+static volatile __bit tx_idle = 1;  /* nothing is being sent */
+static volatile __data unsigned char tx_rptr, tx_wptr;
+static __idata char tx_buf[TX_SIZE];
+__data struct stdio_stats stdio_stats;
+
+/* have the interrupt send whatever is next, when nothing is being sent; that
+ * must not be interrupted between looking at tx_idle and clearing it */
+#define TX_START() do { \
+	if (tx_idle) { \
+		tx_idle = 0; \
+		TI = 1; \
+	} \
+} while (0)
+
+/* stop or restart the host; a macro, as the ISR uses it, and only ever called
+ * with the serial interrupt disabled */
+#if defined FLOW_XONXOFF
+static volatile __data char tx_flow;  /* XON or XOFF to jump the queue, or 0 */
+#define FLOW(stop) do { \
+	tx_flow = (stop) ? XOFF : XON; \
+	rx_stopped = (stop); \
+	TX_START(); \
+} while (0)
+#elif defined FLOW_RTS
+#define FLOW(stop) (STDIO_RTS = rx_stopped = (stop))
+#endif
+#if defined FLOW_XONXOFF || defined FLOW_RTS
+static volatile __bit rx_stopped;
+#endif
+void stdio_isr(void) __interrupt (SI0_VECTOR) __using (1)
 {
+	PROFILE_VAR(t);
 	if (RI) {
-		unsigned char next;
+		PROFILE_START(t);
 		RI = 0;
-		next = rx_wptr + 1;
-		next %= sizeof rx_buf;
-		if (next != rx_rptr) {
-			rx_buf[rx_wptr] = SBUF;
-			rx_wptr = next;
+		if ((unsigned char)(rx_wptr - rx_rptr) != RX_SIZE) {
+			rx_buf[rx_wptr & RX_SIZE - 1] = SBUF;
+			++rx_wptr;
+		} else {
+			++stdio_stats.rx_overruns;
 		}
+#ifdef FLOW
+		if (!rx_stopped && (unsigned char)(rx_wptr - rx_rptr)
+				>= RX_SIZE - STDIO_RX_STOP)
+			FLOW(1);
+#endif
+		PROFILE_STOP(PROFILE_ISR_RX, t);
 	}
 	if (TI) {
+		PROFILE_START(t);
 		TI = 0;
-		if (tx_empty) {
-			tx_idle = 1;
+#ifdef FLOW_XONXOFF
+		if (tx_flow) {
+			SBUF = tx_flow;
+			tx_flow = 0;
+		} else
+#endif
+		if (tx_rptr != tx_wptr) {
+			SBUF = tx_buf[tx_rptr & TX_SIZE - 1];
+			++tx_rptr;
 		} else {
-			SBUF = tx_buf[tx_rptr++];
-			tx_rptr %= sizeof tx_buf;
-			if (tx_rptr == tx_wptr)
-				tx_empty = 1;
+			tx_idle = 1;
 		}
+		PROFILE_STOP(PROFILE_ISR_TX, t);
 	}
 }
 
+/* return non-zero if getchar() would not block */
+__bit stdio_rx_ready(void)
+{
+	return rx_rptr != rx_wptr;
+}
+
+/* return the number of bytes that can be received before the buffer overflows */
+unsigned char stdio_rx_free(void)
+{
+	return RX_SIZE - (unsigned char)(rx_wptr - rx_rptr);
+}
+
 char getchar(void)
 {
 	char c;
+	PROFILE_VAR(t);
+	PROFILE_VAR(m);
 	while (rx_rptr == rx_wptr);  /* block until something is available */
-	ES = 0;
-	c = rx_buf[rx_rptr++];
-	rx_rptr %= sizeof rx_buf;
-	ES = 1;
+	PROFILE_START(t);
+	c = rx_buf[rx_rptr & RX_SIZE - 1];
+	++rx_rptr;  /* only now may the ISR reuse the slot */
+#ifdef FLOW
+	if (rx_stopped && (unsigned char)(rx_wptr - rx_rptr)
+			<= RX_SIZE - STDIO_RX_START) {
+		ES = 0;
+		PROFILE_START(m);
+		FLOW(0);
+		PROFILE_STOP(PROFILE_MASKED, m);
+		ES = 1;
+	}
+#endif
+	PROFILE_STOP(PROFILE_GETCHAR, t);
 	return c;
 }
 
+/* transmit a byte as-is, without newline translation */
+void stdio_tx(char c)
+{
+	PROFILE_VAR(t);
+	PROFILE_VAR(m);
+	/* block until there is room */
+	if ((unsigned char)(tx_wptr - tx_rptr) == TX_SIZE) {
+		++stdio_stats.tx_stalls;
+		while ((unsigned char)(tx_wptr - tx_rptr) == TX_SIZE);
+	}
+	PROFILE_START(t);
+	tx_buf[tx_wptr & TX_SIZE - 1] = c;
+	++tx_wptr;  /* only now may the ISR send it */
+	if (tx_idle) {  /* the ISR may start sending XOFF at any time */
+		ES = 0;
+		PROFILE_START(m);
+		TX_START();
+		PROFILE_STOP(PROFILE_MASKED, m);
+		ES = 1;
+	}
+	PROFILE_STOP(PROFILE_STDIO_TX, t);
+}
+
+/* block until everything has been transmitted, down to the stop bit */
+void stdio_flush(void)
+{
+	while (!tx_idle);
+}
+
 void putchar(char c)
 {
 	if (c == '\n')
-		putchar('\r');
-	if (tx_idle) {
-		tx_idle = 0;
-		SBUF = c;
-	} else {
-		/* block until there is room */
-		while (tx_rptr == tx_wptr && !tx_empty);
-		if (tx_idle) {
-			tx_idle = 0;
-			SBUF = c;
-		} else {
-			ES = 0;
-			tx_empty = 0;
-			tx_buf[tx_wptr++] = c;
-			tx_wptr %= sizeof tx_buf;
-			ES = 1;
-		}
-	}
+		stdio_tx('\r');
+	stdio_tx(c);
 }
 
 int puts(const char *s)
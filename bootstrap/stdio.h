@@ -3,8 +3,35 @@
 
 #define BUFSIZ 0x20
 
+/* receive flow control, chosen at build time: -DFLOW_XONXOFF sends XOFF when
+ * no more than STDIO_RX_STOP bytes of the receive buffer are free and XON once
+ * STDIO_RX_START are, and -DFLOW_RTS does the same by driving STDIO_RTS high
+ * and low, for the host's CTS */
+#ifndef STDIO_RX_STOP
+#define STDIO_RX_STOP 0x10
+#endif
+#ifndef STDIO_RX_START
+#define STDIO_RX_START 0x20
+#endif
+#ifndef STDIO_RTS
+#define STDIO_RTS P1_2
+#endif
+#define XON 0x11
+#define XOFF 0x13
+
+/* counters since power-on, for the "stats" command */
+struct stdio_stats {
+	unsigned short rx_overruns;  /* bytes dropped for want of room */
+	unsigned short tx_stalls;  /* times stdio_tx() waited for room */
+};
+extern __data struct stdio_stats stdio_stats;
+
 char getchar(void);
 void putchar(char);
 int puts(const char *);
+void stdio_tx(char);
+__bit stdio_rx_ready(void);
+unsigned char stdio_rx_free(void);
+void stdio_flush(void);
 
 #endif
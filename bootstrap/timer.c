@@ -0,0 +1,48 @@
+#include <mcs51/p89v51rd2.h>
+
+#include "timer.h"
+
+/* timer 0 runs continuously, and its overflows are counted whenever it is
+ * looked at; a tick goes uncounted if nothing looks for longer than one, which
+ * can make a wait run long, but never short */
+static unsigned short ticks;
+unsigned short timer_ticks(void)
+{
+	if (TF0) {
+		TF0 = 0;
+		++ticks;
+	}
+	return ticks;
+}
+
+/* timer 1 counts machine cycles from power-on, for timing what takes too long
+ * between looks at timer 0 for its ticks to be counted, and its interrupt
+ * counts its overflows; it shares register bank 1 with the serial interrupt,
+ * which it can't interrupt, at the same priority */
+static volatile __data unsigned short cycles_high;
+void timer1_isr(void) __interrupt (TF1_VECTOR) __using (1)
+{
+	++cycles_high;
+}
+
+unsigned long timer_cycles(void)
+{
+	unsigned short high;
+	unsigned char h, l;
+	do {
+		high = cycles_high;
+		h = TH1;
+		l = TL1;
+	} while (h != TH1 || high != cycles_high);
+	if (TF1 && h < 0x80)  /* overflowed, and not yet counted */
+		++high;
+	return (unsigned long)high << 16 | (unsigned short)h << 8 | l;
+}
+
+/* pretty accurate delay in milliseconds up to 6.5 seconds */
+void timer_delay_ms(unsigned short ms)
+{
+	unsigned short start = timer_ticks();
+	ms = ms * TIMER_TICKS_PER_MS + 1;  /* the first tick may be early */
+	while ((unsigned short)(timer_ticks() - start) < ms);
+}
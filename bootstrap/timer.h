@@ -0,0 +1,13 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/* ticks of timer 0, set up by main() to overflow every 100 us, or rather every
+ * TIMER_TICK_CYCLES machine cycles (12 clocks), rounded up */
+#define TIMER_TICKS_PER_MS 10
+#define TIMER_TICK_CYCLES ((F_CPU / 12 + 9999) / 10000)
+
+unsigned short timer_ticks(void);
+void timer_delay_ms(unsigned short);
+unsigned long timer_cycles(void);
+
+#endif
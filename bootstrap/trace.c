@@ -0,0 +1,47 @@
+#include <mcs51/p89v51rd2.h>
+
+#include "timer.h"
+#include "trace.h"
+
+/* a ring of the latest events; only built with -DTRACE, as it takes
+ * TRACE_SIZE * 8 bytes of XRAM */
+#ifdef TRACE
+static __xdata struct trace_event events[TRACE_SIZE];
+static unsigned char head, count;  /* oldest event, and how many */
+static unsigned short lost;  /* overwritten before they were popped */
+
+/* record an event with five bytes of data, overwriting the oldest if full */
+void trace(unsigned char type, const unsigned char *data)
+{
+	unsigned char i, slot = (head + count) % TRACE_SIZE;
+	if (count == TRACE_SIZE) {
+		head = (head + 1) % TRACE_SIZE;
+		++lost;
+	} else {
+		++count;
+	}
+	events[slot].ticks = timer_ticks();
+	events[slot].type = type;
+	for (i = 0; i < 5; ++i)
+		events[slot].data[i] = data[i];
+}
+
+/* take the oldest event; return zero on success, or non-zero if there are none */
+__bit trace_pop(struct trace_event *event)
+{
+	if (!count)
+		return 1;
+	*event = events[head];
+	head = (head + 1) % TRACE_SIZE;
+	--count;
+	return 0;
+}
+
+/* return how many events were overwritten since the last call */
+unsigned short trace_lost(void)
+{
+	unsigned short n = lost;
+	lost = 0;
+	return n;
+}
+#endif
@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* kinds of trace events, and their five bytes of data */
+#define TRACE_SPI 'S'  /* the instruction, and the last byte received */
+#define TRACE_LOAD 'L'  /* a page streamed by avr_flash_load_page(): the first
+			   instruction's first three bytes, and the count */
+#define TRACE_FILL 'F'  /* a cache line read by fill(): its address, and the
+			   count */
+#define TRACE_RECORD 'R'  /* an Intel HEX record's type, address and length,
+			     and its status character */
+#define TRACE_COMMAND 'C'  /* up to four characters of a command's name, and
+			      non-zero if it printed its usage */
+
+/* the number of events kept, a power of two */
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 0x10
+#endif
+
+#ifdef TRACE
+#ifdef PROFILE
+#error TRACE and PROFILE do not both fit in XRAM
+#endif
+struct trace_event {
+	unsigned short ticks;  /* timer_ticks() when it happened */
+	unsigned char type;
+	unsigned char data[5];
+};
+
+void trace(unsigned char, const unsigned char *);
+__bit trace_pop(struct trace_event *);
+unsigned short trace_lost(void);
+#endif
+
+#endif
@@ -1,5 +1,6 @@
 #!/usr/bin/env python
-import argparse, enum, os, select, termios
+import argparse, binascii, collections, enum, os, select, string, sys, termios,\
+        time
 
 
 class record_type(enum.IntEnum):
@@ -9,6 +10,7 @@ class record_type(enum.IntEnum):
     start_segment_address = 3
     extended_linear_address = 4
     start_linear_address = 5
+    packed_data = 0x10  # not Intel's; see unpack() in bootstrap/bootstrap.c
 
 
 class record(object):
@@ -19,6 +21,178 @@ class record(object):
         f.close()
         return [record(l) for l in buf.splitlines()]
 
+    @staticmethod
+    def write_hex(filename, data, addr = 0):
+        f = open(filename, "w")
+        for i in range(0, len(data), 0x10):
+            f.write("%s\n" % record(
+                addr = addr + i,
+                data = list(data[i:i + 0x10]),
+            ))
+        f.write("%s\n" % record(rec_type = record_type.end_of_file))
+        f.close()
+
+    @staticmethod
+    def segment(records, upper = 0):
+        """the data records in the 64 KB segment chosen by extended linear
+        address records"""
+        data, current = [], 0
+        for rec in records:
+            if rec.rec_type == record_type.end_of_file:
+                break
+            if rec.rec_type == record_type.extended_linear_address:
+                current = rec.data[0] << 8 | rec.data[1]
+            elif rec.rec_type == record_type.data and current == upper:
+                data.append(rec)
+        return data
+
+    @staticmethod
+    def merge(records, upper, data):
+        """append data records to an image, in the given 64 KB segment"""
+        records = [r for r in records
+                if r.rec_type != record_type.end_of_file]
+        records.append(record(
+            rec_type = record_type.extended_linear_address,
+            data = [upper >> 8, upper & 0xff],
+        ))
+        records += data
+        records.append(record(rec_type = record_type.end_of_file))
+        return records
+
+    @staticmethod
+    def pages(records, size):
+        """map each page address touched by the data records (in the first
+        64 KB) to its contents"""
+        image = {}
+        for rec in record.segment(records):
+            for i, d in enumerate(rec.data):
+                addr = rec.addr + i
+                page = image.setdefault(addr & ~(size - 1),
+                        bytearray(b"\xff" * size))
+                page[addr & size - 1] = d
+        return image
+
+    @staticmethod
+    def from_pages(image, max_len):
+        """turn a page map back into records of at most max_len bytes, leaving
+        out runs of 0xff, which the bootstrap fills pages in with"""
+        records = []
+        for addr in sorted(image):
+            page = image[addr]
+            for i in range(0, len(page), max_len):
+                data = page[i:i + max_len]
+                if data.count(0xff) != len(data):
+                    records.append(record(addr = addr + i, data = list(data)))
+        records.append(record(rec_type = record_type.end_of_file))
+        return records
+
+    @staticmethod
+    def coalesce(records, max_len):
+        """sort and merge data records, later ones winning where they overlap,
+        into runs of at most max_len bytes that don't cross a multiple of it"""
+        mem = {}
+        for rec in records:
+            for i, d in enumerate(rec.data):
+                mem[rec.addr + i] = d
+        coalesced = []
+        for addr in sorted(mem):
+            last = coalesced[-1] if coalesced else None
+            if last is not None and addr == last.addr + len(last.data)\
+                    and addr % max_len:
+                last.data.append(mem[addr])
+            else:
+                coalesced.append(record(addr = addr, data = [mem[addr]]))
+        return coalesced
+
+    @staticmethod
+    def normalize(records, size, max_len, eeprom = None):
+        """rebuild an image to be written after a chip erase, so that each
+        flash page is sent once, in order, and in as few records as possible,
+        leaving out pages that would be left blank; EEPROM data, in the eeprom
+        segment, is kept byte for byte but sorted and merged likewise"""
+        current = 0
+        for rec in records:
+            if rec.rec_type == record_type.end_of_file:
+                break
+            if rec.rec_type == record_type.extended_linear_address:
+                current = rec.data[0] << 8 | rec.data[1]
+            elif rec.rec_type == record_type.data:
+                assert current in (0, eeprom), "no memory at 0x%04x%04x"\
+                        % (current, rec.addr)
+        image = {a: p for a, p in record.pages(records, size).items()
+                if p.count(0xff) != size}
+        normalized = record.from_pages(image, max_len)
+        data = record.segment(records, eeprom) if eeprom is not None else []
+        if data:
+            normalized = record.merge(normalized, eeprom,
+                    record.coalesce(data, max_len))
+        return normalized
+
+    @staticmethod
+    def tokens(data, max_len, window = 0x80):
+        """compress data into the tokens of packed data records, greedily
+        taking the longest run or match of 3 to 66 bytes at each point, and
+        group them into payloads of at most max_len bytes; return each payload
+        with the offset in data that it unpacks to"""
+        tokens, pos, literal = [], 0, None  # (offset, token)
+        while pos < len(data):
+            best, token = 0, None
+            run = 1
+            while run < 66 and pos + run < len(data)\
+                    and data[pos + run] == data[pos]:
+                run += 1
+            if run >= 3:
+                best, token = run, [0x80 | run - 3, data[pos]]
+            for d in range(1, min(window, pos) + 1):
+                if best == 66:
+                    break
+                n = 0
+                while n < 66 and pos + n < len(data)\
+                        and data[pos + n] == data[pos + n - d]:
+                    n += 1
+                if n > best:
+                    best, token = n, [0xc0 | n - 3, d - 1]
+            if best >= 3:
+                tokens.append((pos, token))
+                pos += best
+                literal = None
+                continue
+            if literal is None or len(literal) == min(max_len, 0x81):
+                literal = [-1]
+                tokens.append((pos, literal))
+            literal[0] += 1
+            literal.append(data[pos])
+            pos += 1
+        payloads = []
+        for offset, token in tokens:
+            if not payloads or len(payloads[-1][1]) + len(token) > max_len:
+                payloads.append((offset, []))
+            payloads[-1][1].extend(token)
+        return payloads
+
+    @staticmethod
+    def pack(records, max_len, eeprom = None):
+        """replace a normalized image's flash data with packed data records of
+        at most max_len bytes: one stream from its lowest address to its
+        highest, with the gaps as runs of 0xff, which the bootstrap skips"""
+        mem = {}
+        for rec in record.segment(records):
+            for i, d in enumerate(rec.data):
+                mem[rec.addr + i] = d
+        packed = []
+        if mem:
+            base = min(mem)
+            data = [mem.get(a, 0xff) for a in range(base, max(mem) + 1)]
+            packed = [record(
+                rec_type = record_type.packed_data,
+                addr = base + offset,
+                data = payload,
+            ) for offset, payload in record.tokens(data, max_len)]
+        data = record.segment(records, eeprom) if eeprom is not None else []
+        if data:
+            return record.merge(packed, eeprom, data)
+        return packed + [record(rec_type = record_type.end_of_file)]
+
     def __init__(self, buf = None, **fields):
         if buf is not None:
             self.addr = int(buf[3:7], 0x10)
@@ -44,12 +218,18 @@ class record(object):
     def __bytes__(self):
         return bytes(str(self), "UTF-8")
 
+    def frame(self, seq = 0):
+        buf = bytes([seq, len(self.data), self.addr >> 8 & 0xff,
+                self.addr & 0xff, self.rec_type] + self.data)
+        crc = binascii.crc_hqx(buf, 0xffff)
+        return buf + bytes([crc >> 8, crc & 0xff])
+
 
 class target(object):
     targets = None
     @staticmethod
-    def factory(name, *args):
-        return target.targets[name](*args)
+    def factory(name, *args, **kwargs):
+        return target.targets[name](*args, **kwargs)
 
     def __init__(self, filename):
         tty = os.open(filename, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
@@ -65,6 +245,19 @@ class target(object):
         ])
         self.tty = tty
 
+    def set_baud(self, rate):
+        attr = termios.tcgetattr(self.tty)
+        attr[4] = attr[5] = getattr(termios, "B%d" % rate)
+        termios.tcsetattr(self.tty, termios.TCSADRAIN, attr)
+
+    def close(self):
+        pass
+
+    def write(self, buf):
+        while buf:
+            select.select((), (self.tty,), ())
+            buf = buf[os.write(self.tty, buf):]
+
     def send_record(self, rec):
         select.select((), (self.tty,), ())
         os.write(self.tty, bytes(rec))
@@ -101,49 +294,750 @@ class mcs51(target):
             if c == u:
                 break
 
-    def send_hex(self, records):
-        erased = [False] * 0x200  # 0x10000 bytes / 0x80 bytes-per-sector
-        ins = 0
+    sector_size = 0x80
+    # the P89V51RD2's flash blocks, as (address, size), which its ISP can erase
+    # in one command instead of a sector at a time
+    blocks = ((0x0000, 0x2000), (0x2000, 0x2000), (0x4000, 0x4000),
+            (0x8000, 0x4000), (0xc000, 0x4000))
+    # the fraction of a block's sectors an image has to touch for the whole
+    # block to be erased at once; below 1, sectors the image doesn't touch can
+    # be erased along with it
+    block_density = 1.0
+
+    def plan_erase(self, records):
+        """return the erase records for the sectors the data records touch,
+        using a block erase wherever the image is dense enough"""
+        touched = set()
         for rec in records:
-            sector = int(rec.addr / 0x80)
-            if rec.rec_type == record_type.data and not erased[sector]:
-                erased[sector] = True
-                addr = sector * 0x80
-                records.insert(ins, record(
-                    addr = 0,
+            if rec.rec_type == record_type.end_of_file:
+                break
+            if rec.rec_type == record_type.data and rec.data:
+                touched.update(range(rec.addr // self.sector_size,
+                        (rec.addr + len(rec.data) - 1) // self.sector_size
+                        + 1))
+        erases = []
+        for addr, size in self.blocks:
+            first = addr // self.sector_size
+            count = size // self.sector_size
+            sectors = sorted(s for s in touched if first <= s < first + count)
+            if sectors and len(sectors) >= self.block_density * count:
+                erases.append(record(
                     rec_type = 3,
-                    data = [8, addr >> 8 & 0xff, addr & 0xff],
+                    data = [1, addr >> 8],
                 ))
-                ins += 1
-        super().send_hex(records)
+            else:
+                for sector in sectors:
+                    addr = sector * self.sector_size
+                    erases.append(record(
+                        rec_type = 3,
+                        data = [8, addr >> 8 & 0xff, addr & 0xff],
+                    ))
+        return erases
+
+    def send_hex(self, records):
+        super().send_hex(self.plan_erase(records) + list(records))
 
 
 class avr(target):
-    def __init__(self, filename):
+    eeprom_segment = 0x0081  # EEPROM data is at 0x810000 in Intel hex images
+    base_baud = 19200  # F_UART in bootstrap/Makefile
+    # faster standard rates to try, fastest first; the bootstrap turns down
+    # any that its timer can't generate closely enough
+    rates = [r for r in (460800, 230400, 115200, 57600, 38400)
+            if hasattr(termios, "B%d" % r)]
+
+    def __init__(self, filename, binary = False, window = None,
+            incremental = False, wait = None, baud = None, flow = None,
+            gang = None, compress = False, prog = True):
         super().__init__(filename)
+        self.compress = compress
+        self.machine = False  # see set_machine()
+        self.pending = 0  # commands whose ".\n" or "?\n" is still to be read
+        self.binary = binary or window is not None
+        self.window = window
+        self.incremental = incremental
+        self.flow = flow
+        if flow == "rts":  # XON/XOFF is always honored
+            attr = termios.tcgetattr(self.tty)
+            attr[2] |= termios.CRTSCTS
+            termios.tcsetattr(self.tty, termios.TCSANOW, attr)
+        self.baud = self.base_baud
+        self.connect()
+        for rate in self.rates:
+            if self.baud < rate and (baud is None or rate <= baud)\
+                    and self.switch_baud(rate):
+                break
+        if gang is not None:
+            self.prompt()
+            os.write(self.tty, b"gang %x\r" % gang)
+        if prog:  # not to use the store, which needs no avr
+            self.prompt()
+            os.write(self.tty, b"reset prog\r")
+            self.identify()
+        if wait is not None:
+            self.prompt()
+            os.write(self.tty, b"wait %s\r" % wait.encode())
+        self.set_machine()
+
+    def set_machine(self):
+        """have the bootstrap stop echoing what it is sent and prompting for
+        more, if it can, so that it only ever sends back status and output"""
+        self.prompt()
+        os.write(self.tty, b"mode machine\r")
+        self.skip_echo(b"mode machine")
+        self.machine = self.read_line().strip() == b"."
+
+    def command(self, cmd):
+        """send a command without waiting for it to finish"""
         self.prompt()
-        os.write(self.tty, b"reset prog\r")
+        os.write(self.tty, cmd + b"\r")
+        if self.machine:
+            self.pending += 1
+
+    def output(self):
+        """in machine mode, read the lines a command prints; return them and
+        whether it ran"""
+        lines = []
+        while True:
+            line = self.read_line().strip()
+            if line in (b".", b"?"):
+                return lines, line == b"."
+            lines.append(line)
+
+    def identify(self):
+        """learn the part's page and memory sizes from the bootstrap"""
+        line = self.query(b"device")
+        fields = line.split()
+        assert len(fields) == 9, "couldn't identify the device: %s" % line
+        if not int(fields[0], 0x10):
+            print("warning: unrecognized device; assuming %s bytes of flash"
+                    % int(fields[1], 0x10), file = sys.stderr)
+        self.flash_size, self.page_size, self.eeprom_size = (int(x, 0x10)
+                for x in fields[1:4])
+        self.sck = int(fields[8], 0x10)
+        if self.sck:
+            print("note: the SPI clock was slowed to rate %d for this device"
+                    % self.sck, file = sys.stderr)
+
+    def close(self):
+        if self.machine:  # the prompt it sends instead of ".\n" is read next
+            self.prompt()
+            os.write(self.tty, b"mode human\r")
+            self.machine = False
+        if self.baud != self.base_baud:  # leave it as the next run expects
+            self.switch_baud(self.base_baud)
+
+    def connect(self):
+        """get a prompt, at whatever rate (and in whatever mode) an earlier run
+        may have left"""
+        if self.prompt(required = False, poke = b"mode human\r"):
+            return
+        for rate in self.rates:
+            self.set_baud(rate)
+            if self.prompt(required = False, poke = b"mode human\r"):
+                self.baud = rate
+                return
+        self.set_baud(self.base_baud)
+        assert False, "couldn't get a prompt"
 
-    def prompt(self):
+    def switch_baud(self, rate):
+        """have the bootstrap and the tty switch to another baud rate; return
+        whether they did"""
+        if self.query(b"baud %d" % rate) != "ok":
+            return False
+        old = self.baud
+        self.set_baud(rate)
+        for i in range(16):  # the bootstrap waits a second for 'U'
+            os.write(self.tty, b"U")
+            r, w, e = select.select((self.tty,), (), (), 0.05)
+            if r and b"U" in os.read(self.tty, 0x100):
+                os.write(self.tty, b"K")
+                self.baud = rate
+                if self.prompt(required = False):
+                    return True
+                break
+        # the bootstrap gives up within two seconds and goes back
+        self.set_baud(old)
+        self.baud = old
+        time.sleep(2)
+        self.prompt()
+        return False
+
+    def prompt(self, required = True, poke = b"\r"):
+        """wait for the bootstrap to be ready for the next command or record,
+        which in machine mode is when every command sent has finished"""
+        if self.machine:
+            while self.pending:
+                self.output()
+                self.pending -= 1
+            return True
         count, buf = 0, b""
         while buf != b"> ":
             r, w, e = select.select((self.tty,), (), (), 0.08)
             if not r and not w and not e:
                 count += 1
+                if count >= 8 and not required:
+                    return False
                 assert count < 8, "couldn't get a prompt"
-                os.write(self.tty, b"\r")
+                os.write(self.tty, poke)
                 continue
             buf = buf[-1:] + os.read(self.tty, 1)
+        return True
+
+    def read_line(self):
+        buf = b""
+        while buf[-1:] != b"\n":
+            select.select((self.tty,), (), ())
+            buf += os.read(self.tty, 1)
+        return buf
+
+    def query(self, cmd):
+        """run a command and return the line it prints"""
+        self.prompt()
+        os.write(self.tty, cmd + b"\r")
+        if self.machine:
+            lines, ok = self.output()
+            return lines[0].decode() if lines else ""
+        self.skip_echo(cmd)
+        return self.read_line().decode().strip()
+
+    def skip_echo(self, cmd):
+        """read up to the echo of a command, past the output of any command
+        sent without waiting for it, like the "reset" that ends a write"""
+        while not self.read_line().rstrip().endswith(cmd):
+            pass
+
+    def stats(self):
+        """return the bootstrap's counters since power-on, by name"""
+        fields = self.query(b"stats").split()
+        assert fields[:1] == ["stats"], "couldn't read the counters"
+        return {k: int(v, 0x10) for k, v in zip(fields[1::2], fields[2::2])}
+
+    def trace(self):
+        """return the events traced since the last call, oldest first, as
+        (ticks, type, data) tuples, and how many were lost to the ring filling
+        up; or None if the bootstrap was built without -DTRACE"""
+        self.prompt()
+        os.write(self.tty, b"trace\r")
+        if self.machine:
+            lines, ok = self.output()
+            if not ok:
+                return None
+            events = []
+            for line in lines[:-1]:  # the last is "trace end lost <count>"
+                fields = line.decode().split()
+                events.append((int(fields[0], 0x10), fields[1],
+                        bytes.fromhex(fields[2])))
+            return events, int(lines[-1].split()[3], 0x10)
+        self.skip_echo(b"trace")
+        events = []
+        while True:
+            fields = self.read_line().decode().split()
+            if fields[:2] == ["invalid", "command"]:
+                return None
+            if fields[:2] == ["trace", "end"]:
+                return events, int(fields[3], 0x10)
+            events.append((int(fields[0], 0x10), fields[1],
+                    bytes.fromhex(fields[2])))
+
+    gang_reasons = {
+        ".": "ok",
+        "-": "not selected",
+        "S": "out of sync (no 0x53 echo, or an unsteady signature)",
+        "G": "signature differs from the first target's",
+        "V": "read back differently from the first target",
+        "B": "still busy long after a write",
+    }
+
+    def gang_status(self):
+        """return the mask of the targets still in the bootstrap's gang, and a
+        status character for each target (see gang_reasons)"""
+        mask, status = self.query(b"gang").split()
+        return int(mask, 0x10), status
+
+    def verify(self, records):
+        """compare the CRCs of the flash pages with the image's, which in a
+        gang also has the bootstrap drop any target that reads differently from
+        the first; return the addresses of the pages that differ"""
+        self.command(b"reset prog")
+        size = self.page_size
+        image = record.pages(records, size)
+        end = max(image) + size if image else 0
+        crcs = self.read_crcs(0, end) if end else []
+        blank = bytes(b"\xff" * size)
+        bad = [i * size for i, crc in enumerate(crcs)
+                if binascii.crc_hqx(bytes(image.get(i * size, blank)), 0xffff)
+                != crc]
+        self.command(b"reset")
+        return bad
+
+    def read_crcs(self, addr, count):
+        line = self.query(b"crc %x %x" % (addr, count))
+        return [int(x, 0x10) for x in line.split()]
+
+    def read_page(self, addr):
+        line = self.query(b"flash %x" % addr)
+        return bytes.fromhex(line.split()[1])
 
     def send_record(self, record):
         self.prompt()
-        super().send_record(record)
+        if not self.machine:
+            super().send_record(record)
+            return
+        os.write(self.tty, bytes(record))
+        code = self.read_bytes(1)[0]
+        assert code == ord("."),\
+            "error writing \"%(record)s\": 0x%(code)02x ('%(code)c')" % {
+                    "code": code,
+                    "record": record,
+            }
 
-    def send_hex(self, records):
+    def read_bytes(self, count, timeout = None):
+        buf = b""
+        while len(buf) < count:
+            r, w, e = select.select((self.tty,), (), (), timeout)
+            assert r, "timed out after reading %r" % buf
+            buf += os.read(self.tty, count - len(buf))
+        return buf
+
+    def read_ack(self):
+        """read a binary frame's status and sequence number"""
+        status = chr(self.read_bytes(1, 5)[0])
+        # 'L' is a frame length out of range, after which the bootstrap has
+        # left binary mode and gone back to its REPL
+        assert status != "L", "binary upload lost sync (bad frame length)"
+        ack = chr(self.read_bytes(1, 5)[0])
+        assert ack in string.hexdigits,\
+                "binary upload got %r after status %r" % (ack, status)
+        return status, int(ack, 0x10)
+
+    def read_memory(self, memory, addr, count):
+        """read a range of "flash" or "eeprom", a chunk at a time"""
+        # the data is raw, so XON/XOFF must not be taken out of it
+        attr = termios.tcgetattr(self.tty)
+        raw = attr[:]
+        raw[0] &= ~termios.IXON
+        termios.tcsetattr(self.tty, termios.TCSANOW, raw)
+        try:
+            return self.read_chunks(memory, addr, count)
+        finally:
+            termios.tcsetattr(self.tty, termios.TCSANOW, attr)
+
+    def read_chunks(self, memory, addr, count):
+        data = b""
+        while count:
+            n = min(count, 0x400)
+            for retry in range(4):
+                self.command(b"read %s %x %x" % (memory, addr, n))
+                if not self.machine:
+                    self.read_line()
+                buf = self.read_bytes(n + 2, 2)
+                if not binascii.crc_hqx(buf, 0xffff):
+                    break
+            else:
+                raise AssertionError("error reading %s at 0x%04x"
+                        % (memory.decode(), addr))
+            data += buf[:-2]
+            addr += n
+            count -= n
+        return data
+
+    def send_binary(self, records):
+        self.command(b"binary")
+        if not self.machine:
+            self.read_line()
+        credit = int(self.read_line(), 0x10)
+        queue = collections.deque()
+        for rec in records:
+            queue.append(rec)
+            if rec.rec_type == record_type.end_of_file:
+                break
+        pending = collections.deque()  # (sequence number, frame, record)
+        seq, in_flight, errors = 0, 0, 0
+        while queue or pending:
+            # keep as many frames in flight as the receive buffer can hold,
+            # and fewer than 16, or a resend could match a stale sequence
+            # number
+            while queue and len(pending) < min(self.window or 15, 15):
+                frame = queue[0].frame(seq)
+                if pending and in_flight + len(frame) > credit\
+                        and self.flow is None:
+                    break
+                self.write(frame)
+                pending.append((seq, frame, queue.popleft()))
+                seq = seq + 1 & 0xf
+                in_flight += len(frame)
+            status, ack = self.read_ack()
+            seq_ack, frame, rec = pending.popleft()
+            in_flight -= len(frame)
+            if status in "CS" and errors < 4:
+                # the target drops everything until it sees the frame it is
+                # expecting again, so go back and resend from there
+                errors += 1
+                for i in range(len(pending)):
+                    self.read_ack()
+                queue.extendleft(r for s, f, r in reversed(pending))
+                queue.appendleft(rec)
+                pending.clear()
+                seq, in_flight = ack, 0
+                continue
+            assert status == "." and ack == seq_ack,\
+                "error writing \"%(record)s\": 0x%(code)02x ('%(code)c')" % {
+                        "code": ord(status),
+                        "record": rec,
+                }
+            errors = 0
+
+    def send_stream(self, records):
+        """send Intel hex text without waiting for each record's status, and
+        leave it to the bootstrap's flow control to hold off"""
+        sent = []
+        for rec in records:
+            sent.append(rec)
+            if rec.rec_type == record_type.end_of_file:
+                break
+        out = b"".join(str(rec).encode() + b"\r" for rec in sent)
         self.prompt()
-        os.write(self.tty, b"erase\ry")
-        super().send_hex(records)
-        os.write(self.tty, b"reset\r")
+        buf, status = b"", []
+        while len(status) < len(sent):
+            r, w, e = select.select((self.tty,), (self.tty,) if out else (),
+                    (), 5)
+            assert r or w, "timed out after %d records" % len(status)
+            if w:
+                out = out[os.write(self.tty, out):]
+            if r and self.machine:  # a status character for each record
+                buf += os.read(self.tty, 0x1000)
+                status += [buf[i:i + 1] for i in range(len(buf))]
+                buf = b""
+            elif r:
+                buf += os.read(self.tty, 0x1000)
+                lines = buf.split(b"\n")
+                buf = lines.pop()
+                status += [l.rstrip(b"\r")[-1:] for l in lines
+                        if l.lstrip(b"> ").startswith(b":")]
+        for rec, code in zip(sent, status):
+            assert code == b".",\
+                "error writing \"%(record)s\": 0x%(code)02x ('%(code)c')" % {
+                        "code": code[0],
+                        "record": rec,
+                }
+
+    def send_incremental(self, records):
+        """reprogram only the pages whose CRCs differ from the image, and skip
+        the chip erase if none of them needs a bit changed from 0 to 1"""
+        size = self.page_size
+        image = record.pages(records, size)
+        blank = bytes(b"\xff" * size)
+        end = max(image) + size if image else 0
+        crcs = self.read_crcs(0, end) if end else []
+        changed = {}
+        for i, crc in enumerate(crcs):
+            page = image.get(i * size, blank)
+            if binascii.crc_hqx(page, 0xffff) != crc:
+                changed[i * size] = page
+        erase = False
+        for addr, page in changed.items():
+            old = self.read_page(addr)
+            if any(n & ~o for n, o in zip(page, old)):
+                erase = True
+                break
+        if erase:  # the erase takes everything else with it
+            changed = {a: p for a, p in image.items() if p != blank}
+        eeprom = record.segment(records, self.eeprom_segment)
+        records = record.from_pages(changed, self.record_len())
+        if eeprom:  # not worth comparing; just write it
+            records = record.merge(records, self.eeprom_segment,
+                    record.coalesce(eeprom, self.record_len()))
+        self.program(records, erase)
+
+    def record_len(self):
+        """the longest data record the bootstrap takes in the current mode"""
+        return 0x20 if self.binary else 0x10
+
+    def program(self, records, erase = True):
+        if erase:
+            self.command(b"erase")
+            os.write(self.tty, b"y")
+        if self.binary:
+            self.send_binary(records)
+        elif self.flow is not None:
+            self.send_stream(records)
+        else:
+            super().send_hex(records)
+        self.command(b"reset")
+
+    def store(self, records):
+        """add an image to the bootstrap's own store, packed, for its "burn"
+        command and button to write with no host; return the bytes it takes"""
+        assert self.machine, "the bootstrap has no store"
+        records = record.normalize(records, 0x80, 0x20, self.eeprom_segment)
+        records = record.pack(records, 0x20, self.eeprom_segment)
+        line = self.query(b"store add")
+        assert not line, line
+        self.send_binary(records)
+        return sum(len(r.data) + 4 for r in records)
+
+    def store_clear(self):
+        line = self.query(b"store clear")
+        assert not line, line
+
+    def store_list(self):
+        """return the offset and size of each image in the bootstrap's store,
+        and its "images", "free" and "incomplete" counts"""
+        assert self.machine, "the bootstrap has no store"
+        self.prompt()
+        os.write(self.tty, b"store\r")
+        lines, ok = self.output()
+        assert ok, "the bootstrap has no store"
+        fields = lines[-1].decode().split()
+        images = [tuple(int(x, 0x10) for x in l.split()[1:])
+                for l in lines[:-1]]
+        return images, {k: int(v, 0x10)
+                for k, v in zip(fields[1::2], fields[2::2])}
+
+    def send_hex(self, records):
+        if self.incremental:
+            self.send_incremental(records)
+        else:
+            records = record.normalize(records, self.page_size,
+                    self.record_len(), self.eeprom_segment)
+            if self.compress:
+                records = record.pack(records, self.record_len(),
+                        self.eeprom_segment)
+            self.program(records)
+
+
+class farm_board(object):
+    """one programmer of a farm; its session is a generator that yields the
+    seconds it will wait for more output, so that one select() loop can drive
+    every board and a slow or dead one holds up only itself"""
+    timeout = 2  # seconds to wait for a command's output
+    byte_timeout = 0.25  # between the bytes of a record's echo and status
+
+    def __init__(self, filename, records, baud = None):
+        self.name = filename
+        self.records = records
+        self.max_baud = baud
+        self.buf = self.out = b""
+        self.baud = avr.base_baud
+        self.attempts = 1
+        self.resends = 0  # records
+        self.sent = self.total = 0  # data bytes
+        self.error = None
+        self.start = time.time()
+        self.end = None
+        try:
+            self.tty = target(filename).tty
+        except OSError as error:
+            self.error = error
+            self.end = self.start
+
+    def set_baud(self, rate):
+        target.set_baud(self, rate)
+
+    def write(self, buf):
+        self.out += buf  # sent by the loop as the tty takes it
+
+    def sleep(self, seconds):
+        deadline = time.time() + seconds
+        while time.time() < deadline:
+            yield deadline - time.time()
+
+    def expect(self, pattern, timeout = None, poke = None):
+        """wait for pattern, writing poke after each of up to eight timeouts if
+        given; return what came up to it, or None if it never came"""
+        for count in range(8 if poke else 1):
+            deadline = time.time() + (timeout or self.timeout)
+            while pattern not in self.buf:
+                if time.time() >= deadline:
+                    break
+                yield deadline - time.time()
+            else:
+                i = self.buf.index(pattern) + len(pattern)
+                out, self.buf = self.buf[:i], self.buf[i:]
+                return out
+            if poke:
+                self.write(poke)
+        return None
+
+    def require(self, pattern, timeout = None):
+        out = yield from self.expect(pattern, timeout)
+        assert out is not None, "timed out waiting for %r" % pattern
+        return out
+
+    def read_byte(self):
+        """return the next byte of output, or None after a timeout"""
+        deadline = time.time() + self.byte_timeout
+        while not self.buf:
+            if time.time() >= deadline:
+                return None
+            yield deadline - time.time()
+        c, self.buf = self.buf[0], self.buf[1:]
+        return c
+
+    def prompt(self, required = True, poke = b"\r"):
+        out = yield from self.expect(b"> ", 0.08, poke)
+        assert out is not None or not required, "couldn't get a prompt"
+        return out is not None
+
+    def command(self, cmd):
+        """run a command, and return everything it prints"""
+        yield from self.prompt()
+        self.write(cmd + b"\r")
+        yield from self.require(cmd)
+        yield from self.require(b"\n")
+        out = yield from self.require(b"> ")
+        self.buf = b"> " + self.buf  # for the next command
+        return out[:-2].decode().strip()
+
+    def query(self, cmd):
+        """run a command, and return the line it prints"""
+        yield from self.prompt()
+        self.write(cmd + b"\r")
+        yield from self.require(cmd)
+        yield from self.require(b"\n")
+        out = yield from self.require(b"\n")
+        return out.decode().strip()
+
+    def connect(self):
+        """get a prompt, at whatever rate an earlier run may have left"""
+        for rate in [avr.base_baud] + avr.rates:
+            self.set_baud(rate)
+            self.buf = b""
+            if (yield from self.prompt(required = False,
+                    poke = b"mode human\r")):
+                self.baud = rate
+                return
+        assert False, "couldn't get a prompt"
+
+    def switch_baud(self, rate):
+        """as avr.switch_baud()"""
+        if (yield from self.query(b"baud %d" % rate)) != "ok":
+            return False
+        old = self.baud
+        self.set_baud(rate)
+        self.buf = b""
+        for i in range(16):  # the bootstrap waits a second for 'U'
+            self.write(b"U")
+            if (yield from self.expect(b"U", 0.05)) is not None:
+                self.write(b"K")
+                self.baud = rate
+                if (yield from self.prompt(required = False)):
+                    return True
+                break
+        # the bootstrap gives up within two seconds and goes back
+        self.set_baud(old)
+        self.baud = old
+        yield from self.sleep(2)
+        self.buf = b""
+        yield from self.prompt()
+        return False
+
+    def session(self):
+        yield from self.connect()
+        for rate in avr.rates:
+            if self.baud < rate and (self.max_baud is None
+                    or rate <= self.max_baud)\
+                    and (yield from self.switch_baud(rate)):
+                break
+        out = yield from self.command(b"reset prog")
+        assert "failed" not in out, out
+        fields = (yield from self.query(b"device")).split()
+        assert len(fields) == 9, "couldn't identify the device"
+        records = record.normalize(self.records, int(fields[2], 0x10), 0x10,
+                avr.eeprom_segment)
+        data = [r for r in records if r.rec_type == record_type.data]
+        self.sent, self.total = 0, sum(len(r.data) for r in data)
+        yield from self.prompt()
+        self.write(b"erase\ry")
+        yield from self.require(b"y\r\n")
+        for rec in records:
+            for i in range(4):
+                yield from self.prompt()
+                self.buf = b""
+                self.write(bytes(rec))
+                while True:  # past the echo, to the status
+                    code = yield from self.read_byte()
+                    if code is None\
+                            or code not in b"\n\r0123456789ABCDEFabcdef:":
+                        break
+                if code == ord("."):
+                    break
+                if code is None:  # it lost the record's start or end
+                    self.write(b"\r")
+                self.resends += 1  # it was rejected, and not written
+            assert code is not None, "timed out writing \"%s\"" % rec
+            assert code == ord("."),\
+                "error writing \"%(record)s\": 0x%(code)02x ('%(code)c')" % {
+                        "code": code,
+                        "record": rec,
+                }
+            if rec.rec_type == record_type.data:
+                self.sent += len(rec.data)
+            elif rec.rec_type == record_type.end_of_file:
+                break
+        yield from self.prompt()
+        self.write(b"reset\r")
+        if self.baud != avr.base_baud:  # leave it as the next run expects
+            yield from self.switch_baud(avr.base_baud)
+
+    def status(self):
+        if self.error is not None:
+            return "failed"
+        if self.end is not None:
+            return "done"
+        progress = "%d%%" % (100 * self.sent // self.total) if self.total\
+                else "connecting"
+        return progress if self.attempts == 1\
+                else "%s (try %d)" % (progress, self.attempts)
+
+
+def farm(boards, retries = 2, progress = 1.0):
+    """run the boards' sessions until each one has finished, or failed after
+    retries more attempts"""
+    active = {}  # board: (session, time to resume it)
+    for board in boards:
+        if board.error is None:
+            active[board] = (board.session(), 0)
+    shown = time.time()
+    while active:
+        now = time.time()
+        wake = min(t for s, t in active.values())
+        r, w, e = select.select([b.tty for b in active],
+                [b.tty for b in active if b.out], (),
+                max(0, wake - now))
+        now = time.time()
+        for board, (session, t) in list(active.items()):
+            try:
+                if board.out and board.tty in w:
+                    board.out = board.out[os.write(board.tty, board.out):]
+                ready = board.tty in r
+                if ready:
+                    board.buf += os.read(board.tty, 0x1000)
+                if not ready and now < t:
+                    continue
+                active[board] = (session, now + next(session))
+            except StopIteration:
+                board.end = now
+                del active[board]
+            except (AssertionError, OSError) as error:
+                if board.attempts > retries:
+                    board.error = error
+                    board.end = now
+                    del active[board]
+                    continue
+                board.attempts += 1
+                try:
+                    termios.tcflush(board.tty, termios.TCIOFLUSH)
+                except OSError:
+                    pass
+                board.buf = board.out = b""
+                active[board] = (board.session(), now)
+        if progress and now - shown >= progress:
+            shown = now
+            print("  ".join("%s %s" % (b.name, b.status()) for b in boards),
+                    file = sys.stderr)
+    return [b for b in boards if b.error is not None]
 
 
 target.targets = {
@@ -156,18 +1050,288 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser(
             description = "A simple serial flash programmer.",
     )
-    parser.add_argument("image",
+    commands = parser.add_subparsers(dest = "command")
+    write = commands.add_parser("write",
+            help = "write a program image to the target (the default)",
+    )
+    write.add_argument("image",
             help = "the program image to be flashed (in Intel hex format)",
     )
-    parser.add_argument("ttyS",
+    write.add_argument("ttyS",
             help = "serial device to which the program image shall be written",
     )
-    parser.add_argument("-t", "--target",
+    write.add_argument("-t", "--target",
             default = "avr",
             help = "target architecture",
             metavar = "TARG",
     )
+    write.add_argument("-b", "--binary",
+            action = "store_true",
+            help = "upload binary frames instead of Intel hex text (avr only)",
+    )
+    write.add_argument("-w", "--window",
+            type = int,
+            help = "keep at most N binary frames in flight (implies -b)",
+            metavar = "N",
+    )
+    write.add_argument("-i", "--incremental",
+            action = "store_true",
+            help = "only reprogram pages that differ from the image (avr only)",
+    )
+    write.add_argument("-e", "--eeprom",
+            help = "also write EEPROM from an Intel hex image (avr only)",
+            metavar = "IMAGE",
+    )
+    write.add_argument("--baud",
+            type = int,
+            help = "fastest baud rate to negotiate (default: no limit; 19200"
+                    " to stay there) (avr only)",
+            metavar = "RATE",
+    )
+    write.add_argument("--wait",
+            choices = ("rdy", "data", "time"),
+            help = "how to tell that a write cycle is done: poll RDY/BSY, poll"
+                    " the data, or wait the datasheet time (avr only)",
+    )
+    write.add_argument("--flow",
+            choices = ("xonxoff", "rts"),
+            help = "stream without waiting for each record, as the bootstrap"
+                    " was built to hold off with XON/XOFF or RTS (avr only)",
+    )
+    write.add_argument("-g", "--gang",
+            type = lambda x: int(x, 0),
+            help = "program the ganged targets in MASK at once, verify them,"
+                    " and report on each (avr only)",
+            metavar = "MASK",
+    )
+    write.add_argument("-z", "--compress",
+            action = "store_true",
+            help = "upload the flash data packed (runs and repeats), for the"
+                    " bootstrap to unpack, and report the gain (avr only)",
+    )
+    write.add_argument("-s", "--stats",
+            action = "store_true",
+            help = "print the bootstrap's counters for the write, and its"
+                    " trace if it was built with one, on stderr (avr only)",
+    )
+    read = commands.add_parser("read",
+            help = "read an avr's program memory or EEPROM into a file",
+    )
+    read.add_argument("ttyS",
+            help = "serial device from which memory shall be read",
+    )
+    read.add_argument("output",
+            help = "file to be written (Intel hex if it ends in .hex)",
+    )
+    read.add_argument("-e", "--eeprom",
+            action = "store_true",
+            help = "read EEPROM instead of program memory",
+    )
+    read.add_argument("-a", "--addr",
+            default = 0,
+            type = lambda x: int(x, 0),
+            help = "first address to read",
+            metavar = "ADDR",
+    )
+    read.add_argument("-c", "--count",
+            type = lambda x: int(x, 0),
+            help = "number of bytes to read (default: up to the end)",
+            metavar = "COUNT",
+    )
+    read.add_argument("--baud",
+            type = int,
+            help = "fastest baud rate to negotiate (default: no limit; 19200"
+                    " to stay there)",
+            metavar = "RATE",
+    )
+    read.add_argument("-f", "--format",
+            choices = ("bin", "hex"),
+            help = "output format (default: by the file name)",
+    )
+    farm_parser = commands.add_parser("farm",
+            help = "write the same image to avrs through several programmers"
+                    " at once",
+    )
+    farm_parser.add_argument("image",
+            help = "the program image to be flashed (in Intel hex format)",
+    )
+    farm_parser.add_argument("ttyS",
+            nargs = "+",
+            help = "serial devices of the programmers",
+    )
+    farm_parser.add_argument("-e", "--eeprom",
+            help = "also write EEPROM from an Intel hex image",
+            metavar = "IMAGE",
+    )
+    farm_parser.add_argument("--baud",
+            type = int,
+            help = "fastest baud rate to negotiate (default: no limit; 19200"
+                    " to stay there)",
+            metavar = "RATE",
+    )
+    farm_parser.add_argument("-r", "--retries",
+            default = 2,
+            type = int,
+            help = "times to start a board over after an error (default: 2)",
+            metavar = "N",
+    )
+    store_parser = commands.add_parser("store",
+            help = "keep images in the bootstrap's own flash, for its \"burn\""
+                    " command and button to write to avrs with no host",
+    )
+    store_parser.add_argument("ttyS",
+            help = "serial device of the programmer",
+    )
+    store_parser.add_argument("image",
+            nargs = "*",
+            help = "program images to add (in Intel hex format), each followed"
+                    " by a comma and an EEPROM image for it if there is one",
+    )
+    store_parser.add_argument("-c", "--clear",
+            action = "store_true",
+            help = "erase the images already stored first",
+    )
+    store_parser.add_argument("--baud",
+            type = int,
+            help = "fastest baud rate to negotiate (default: no limit; 19200"
+                    " to stay there)",
+            metavar = "RATE",
+    )
+    if len(sys.argv) > 1 and sys.argv[1] not in ("read", "write", "farm",
+            "store", "-h", "--help"):
+        sys.argv.insert(1, "write")  # "write" is implied
     args = parser.parse_args()
-    records = record.parse_hex(args.image)
-    targ = target.factory(args.target, args.ttyS)
-    targ.send_hex(records)
+    if args.command == "read":
+        targ = avr(args.ttyS, baud = args.baud)
+        memory, size = (b"eeprom", targ.eeprom_size) if args.eeprom\
+                else (b"flash", targ.flash_size)
+        count = size - args.addr if args.count is None else args.count
+        data = targ.read_memory(memory, args.addr, count)
+        targ.command(b"reset")
+        targ.close()
+        fmt = args.format or ("hex" if args.output.endswith(".hex")
+                else "bin")
+        if fmt == "hex":
+            record.write_hex(args.output, data, args.addr)
+        else:
+            f = open(args.output, "wb")
+            f.write(data)
+            f.close()
+    elif args.command == "write":
+        records = record.parse_hex(args.image)
+        if args.eeprom is not None:
+            records = record.merge(records, avr.eeprom_segment,
+                    record.segment(record.parse_hex(args.eeprom)))
+        options = {}
+        if args.binary:
+            options["binary"] = True
+        if args.window is not None:
+            options["window"] = args.window
+        if args.incremental:
+            options["incremental"] = True
+        if args.wait is not None:
+            options["wait"] = args.wait
+        if args.baud is not None:
+            options["baud"] = args.baud
+        if args.flow is not None:
+            options["flow"] = args.flow
+        if args.gang is not None:
+            if args.incremental:  # the targets' old contents may differ
+                parser.error("--gang can't be combined with --incremental")
+            options["gang"] = args.gang
+        if args.compress:
+            if args.incremental:  # that sends only the pages that changed
+                parser.error("--compress can't be combined with --incremental")
+            options["compress"] = True
+        targ = target.factory(args.target, args.ttyS, **options)
+        if args.stats:
+            before = targ.stats()
+            targ.trace()  # only this write's events
+        targ.send_hex(records)
+        failed = False
+        if args.compress:
+            stats = targ.stats()
+            packed, unpacked = stats["packed_in"], stats["packed_out"]
+            seconds = stats["packed_ticks"] / 10000
+            print("packed %d bytes into %d (%.2f:1), unpacked at %.0f bytes/s"
+                    % (unpacked, packed, unpacked / packed if packed else 0,
+                    unpacked / seconds if seconds else 0), file = sys.stderr)
+        if args.gang is not None:
+            bad = targ.verify(records)
+            mask, status = targ.gang_status()
+            for t, code in enumerate(status):
+                reason = targ.gang_reasons.get(code, code)
+                if code == "." and bad:
+                    reason = "verify error at 0x%04x" % bad[0]
+                failed |= reason not in ("ok", "not selected")
+                print("target %d: %s" % (t, reason), file = sys.stderr)
+        if args.stats:
+            after = targ.stats()
+            for k, v in after.items():
+                print("%s %d" % (k, v - before.get(k, 0)), file = sys.stderr)
+            writes = after["writes"] - before["writes"]
+            if writes:
+                print("polls per write %.1f"
+                        % ((after["polls"] - before["polls"]) / writes),
+                        file = sys.stderr)
+            trace = targ.trace()
+            if trace is not None:
+                events, lost = trace
+                if lost:
+                    print("trace: %d earlier events lost" % lost,
+                            file = sys.stderr)
+                for ticks, kind, data in events:
+                    print("%6.1fms %s %s" % (ticks / 10, kind, data.hex()),
+                            file = sys.stderr)
+        targ.close()
+        if failed:
+            sys.exit(1)
+    elif args.command == "farm":
+        records = record.parse_hex(args.image)
+        if args.eeprom is not None:
+            records = record.merge(records, avr.eeprom_segment,
+                    record.segment(record.parse_hex(args.eeprom)))
+        boards = [farm_board(tty, records, args.baud) for tty in args.ttyS]
+        start = time.time()
+        failed = farm(boards, args.retries)
+        elapsed = time.time() - start
+        written = 0
+        for board in boards:
+            took = board.end - board.start
+            if board.error is not None:
+                print("%s: failed (tried %d times): %s" % (board.name,
+                        board.attempts, board.error), file = sys.stderr)
+                continue
+            written += board.sent
+            print("%s: %d bytes in %.1fs (%.0f bytes/s), %d retries, %d"
+                    " records resent" % (board.name, board.sent, took,
+                    board.sent / took, board.attempts - 1, board.resends),
+                    file = sys.stderr)
+        print("farm: %d of %d boards written, %d bytes in %.1fs (%.0f bytes/s)"
+                % (len(boards) - len(failed), len(boards), written, elapsed,
+                written / elapsed), file = sys.stderr)
+        if failed:
+            sys.exit(1)
+    elif args.command == "store":
+        targ = avr(args.ttyS, baud = args.baud, prog = False)
+        if args.clear:
+            targ.store_clear()
+        images, counts = targ.store_list()
+        for name in args.image:
+            flash, comma, eeprom = name.partition(",")
+            records = record.parse_hex(flash)
+            if eeprom:
+                records = record.merge(records, avr.eeprom_segment,
+                        record.segment(record.parse_hex(eeprom)))
+            size = targ.store(records)
+            print("image %d: %s, %d bytes" % (len(images), name, size),
+                    file = sys.stderr)
+            images, counts = targ.store_list()
+        print("store: %d images, %d bytes free" % (counts["images"],
+                counts["free"]), file = sys.stderr)
+        if counts["incomplete"]:
+            print("warning: %d bytes of an incomplete image; use --clear"
+                    % counts["incomplete"], file = sys.stderr)
+        targ.close()
+    else:
+        parser.print_usage()
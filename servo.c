@@ -0,0 +1,237 @@
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "servo.h"
+
+/* the pulse width of a channel value, with the sign of the old OCR1B = 12 -
+ * speed: from SERVO_MID + SERVO_HALF at -128 to SERVO_MID - SERVO_HALF */
+#define SERVO_MID ((unsigned short)((SERVO_MIN + SERVO_MAX) / 2))
+#define SERVO_HALF ((short)((SERVO_MAX - SERVO_MIN) / 2))
+#define SERVO_FALL 0x80  /* in an edge, with the slot number */
+/* the last group runs on through the sync gap to the end of the frame */
+#define SERVO_LAST (SERVO_FRAME - (SERVO_GROUPS - 1) * SERVO_GROUP)
+
+/* a write of the slot lines, and the ticks until the next one */
+struct servo_event {
+	unsigned char port, delta;
+};
+
+/* a group's edges, merged and padded out with writes that change nothing where
+ * a gap is too long for one delta */
+struct servo_schedule {
+	unsigned char len;
+	struct servo_event event[2 * SERVO_SLOTS + SERVO_LAST / 0x80];
+};
+
+static const unsigned char slot_bits[SERVO_SLOTS] = SERVO_SLOT_BITS;
+static signed char values[SERVO_CHANNELS];
+
+/* the interrupt plays one schedule while servo_poll() builds the next group's
+ * in the other, and hands it over by setting ready */
+static struct servo_schedule schedules[2];
+static const struct servo_event *next, *end;
+static volatile unsigned char playing, ready, group;
+
+#ifdef SERVO_STATS
+static unsigned short frame_cycles;
+static unsigned char frame_events;
+
+volatile struct servo_stats servo_stats;
+#endif
+
+/* end an event the given number of ticks before the next; return the index of
+ * the next */
+static unsigned char servo_delta(struct servo_event *event, unsigned char n,
+		unsigned short ticks)
+{
+	while (ticks > 0xff) {
+		event[n].delta = 0x80;
+		event[n + 1].port = event[n].port;
+		++n;
+		ticks -= 0x80;
+	}
+	event[n].delta = ticks;
+	return n + 1;
+}
+
+/* schedule the edges of the g'th group in the frame: as in notes.txt, the slots
+ * of a group are channels SERVO_GROUPS apart, and the groups are interleaved to
+ * spread neighbouring channels out over the frame; an edge less than
+ * SERVO_MIN_GAP ticks after the one before it is moved up to it */
+static void servo_build(struct servo_schedule *schedule, unsigned char g)
+{
+	const signed char *value = values + g / 2
+		+ (g & 1) * ((SERVO_GROUPS + 1) / 2);
+	struct servo_event *event = schedule->event;
+	unsigned short time[2 * SERVO_SLOTS], at;
+	unsigned char edge[2 * SERVO_SLOTS], i, n, port;
+
+	for (i = 0; i < SERVO_SLOTS; ++i) {
+		unsigned short rise = i * SERVO_STAGGER;
+		time[2 * i] = rise;
+		edge[2 * i] = i;
+		time[2 * i + 1] = rise + SERVO_MID
+			- value[i * SERVO_GROUPS] * SERVO_HALF / 128;
+		edge[2 * i + 1] = i | SERVO_FALL;
+	}
+	for (i = 1; i < 2 * SERVO_SLOTS; ++i) {  /* insertion sort, by time */
+		unsigned short t = time[i];
+		unsigned char e = edge[i], j;
+		for (j = i; j && time[j - 1] > t; --j) {
+			time[j] = time[j - 1];
+			edge[j] = edge[j - 1];
+		}
+		time[j] = t;
+		edge[j] = e;
+	}
+
+	port = 0;
+	n = 0;
+	at = 0;
+	for (i = 0; i < 2 * SERVO_SLOTS; ++i) {
+		unsigned char bit = slot_bits[edge[i] & ~SERVO_FALL];
+		if (time[i] - at >= SERVO_MIN_GAP) {
+			n = servo_delta(event, n, time[i] - at);
+			at = time[i];
+		}
+		if (edge[i] & SERVO_FALL)
+			port &= ~bit;
+		else
+			port |= bit;
+		event[n].port = port;
+	}
+	schedule->len = servo_delta(event, n,
+			(g == SERVO_GROUPS - 1 ? SERVO_LAST : SERVO_GROUP) - at);
+}
+
+/* timer 0 matches at each event; with SERVO_STATS, the compare match is at
+ * cycle 8 * OCR0A of timer 1, modulo 256, since servo_init() started the two
+ * together */
+ISR(TIM0_COMPA_vect)
+{
+	const struct servo_event *e = next;
+	unsigned char match = OCR0A;
+#ifdef SERVO_STATS
+	unsigned char start = match << 3, cycles;
+#endif
+	PORTB = e->port;
+#ifdef SERVO_STATS
+	cycles = TCNT1 - start;
+#endif
+	OCR0A = match + e->delta;
+	if ((unsigned char)(TCNT0 - match) >= e->delta) {  /* missed it */
+		OCR0A = TCNT0 + 2;
+#ifdef SERVO_STATS
+		++servo_stats.slips;
+#endif
+	}
+	if (++e == end) {
+		if (ready) {
+			playing ^= 1;
+			ready = 0;
+		}
+#ifdef SERVO_STATS
+		else
+			++servo_stats.late;
+#endif
+		e = schedules[playing].event;
+		end = e + schedules[playing].len;
+		if (++group == SERVO_GROUPS) {
+			group = 0;
+#ifdef SERVO_STATS
+			if (frame_cycles > servo_stats.frame_cycles) {
+				servo_stats.frame_cycles = frame_cycles;
+				servo_stats.frame_events = frame_events;
+			}
+			frame_cycles = 0;
+			frame_events = 0;
+#endif
+		}
+	}
+	next = e;
+#ifdef SERVO_STATS
+	if (cycles < servo_stats.lat_min)
+		servo_stats.lat_min = cycles;
+	if (cycles > servo_stats.lat_max)
+		servo_stats.lat_max = cycles;
+	frame_cycles += (unsigned char)(TCNT1 - start);
+	++frame_events;
+#endif
+}
+
+/* schedule the first two groups and start timer 0 at F_CPU / 8 for the edges,
+ * and with SERVO_STATS, timer 1 counting cycles alongside it */
+void servo_init(void)
+{
+	unsigned char i;
+	for (i = 0; i < SERVO_SLOTS; ++i)
+		DDRB |= slot_bits[i];
+	servo_build(schedules, 0);
+	servo_build(schedules + 1, 1);
+	next = schedules[0].event;
+	end = next + schedules[0].len;
+	ready = 1;
+#ifdef SERVO_STATS
+	servo_stats_clear();
+#endif
+
+	GTCCR = 1 << TSM | 1 << PSR1 | 1 << PSR0;  /* hold the prescalers */
+	TCNT0 = 0;
+	OCR0A = SERVO_MIN_GAP;
+	TCCR0A = 0;
+	TCCR0B = 1 << CS01;  /* F_CPU / 8 */
+#ifdef SERVO_STATS
+	TCNT1 = 0;
+	TCCR1 = 1 << CS10;  /* F_CPU */
+#endif
+	TIMSK |= 1 << OCIE0A;
+	GTCCR = 0;
+}
+
+/* set a channel, from the next time its group is scheduled */
+void servo_set(unsigned char channel, signed char value)
+{
+	if (channel < SERVO_CHANNELS)
+		values[channel] = value;
+}
+
+/* schedule the group after the one playing, if it has not been already; this
+ * must be called at least once a group */
+void servo_poll(void)
+{
+	unsigned char next_group;
+#ifdef SERVO_STATS
+	unsigned char t;
+#endif
+	if (ready)
+		return;
+	next_group = group + 1;
+	if (next_group == SERVO_GROUPS)
+		next_group = 0;
+#ifdef SERVO_STATS
+	t = TCNT0;
+#endif
+	servo_build(schedules + (playing ^ 1), next_group);
+#ifdef SERVO_STATS
+	t = TCNT0 - t;
+	if (t > servo_stats.build_ticks)
+		servo_stats.build_ticks = t;
+#endif
+	ready = 1;
+}
+
+#ifdef SERVO_STATS
+void servo_stats_clear(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		servo_stats.lat_min = 0xff;
+		servo_stats.lat_max = 0;
+		servo_stats.frame_cycles = 0;
+		servo_stats.frame_events = 0;
+		servo_stats.build_ticks = 0;
+		servo_stats.late = 0;
+		servo_stats.slips = 0;
+	}
+}
+#endif
@@ -0,0 +1,94 @@
+#ifndef SERVO_H
+#define SERVO_H
+
+/* SERVO_GROUPS * SERVO_SLOTS servo channels multiplexed into one frame (see
+ * notes.txt): the frame is cut into SERVO_GROUPS equal groups and a sync gap,
+ * and in each group the pulses of SERVO_SLOTS channels start SERVO_STAGGER_US
+ * apart on the slot lines, which all of the groups share; an external decade
+ * counter, clocked by the rising edge of slot 0 at the start of every group,
+ * gates the slot lines through to the group's own servos, group n on Qn
+ *
+ * the counter's reset comes from slot 0 through a timeout: slot 0 charges a
+ * capacitor through a diode and a small resistor, a larger one discharges it,
+ * and a Schmitt inverter on the capacitor drives the counter's RESET once slot
+ * 0 has been low for longer than it ever is inside the groups (SERVO_GROUP -
+ * SERVO_MIN), which it only is through the sync gap; the counter then sits at
+ * Q0 until group 0's edge, which it ignores, since RESET is still high until
+ * the capacitor charges, and so it comes back in step every frame.  With
+ * pull-downs on the slot lines, the same holds at power-on and while the ATtiny
+ * is held in reset for ISP, and its first edge afterwards is group 0's
+ *
+ * an ATtiny25 with the USI as an SPI slave and RESET kept for ISP has only PB3
+ * and PB4 left over, so the default is nine groups of two rather than six
+ * groups of three, with a stagger just wide enough to keep every edge in a
+ * group SERVO_MIN_GAP ticks clear of the others */
+#ifndef SERVO_GROUPS
+#define SERVO_GROUPS 9
+#endif
+#ifndef SERVO_SLOTS
+#define SERVO_SLOTS 2
+#define SERVO_SLOT_BITS {1 << PB3, 1 << PB4}
+#endif
+#define SERVO_CHANNELS (SERVO_GROUPS * SERVO_SLOTS)
+
+#ifndef SERVO_FRAME_US
+#define SERVO_FRAME_US 22500
+#endif
+#ifndef SERVO_SYNC_US
+#define SERVO_SYNC_US 2500
+#endif
+#ifndef SERVO_MIN_US
+#define SERVO_MIN_US 1300
+#endif
+#ifndef SERVO_MAX_US
+#define SERVO_MAX_US 1700
+#endif
+#ifndef SERVO_STAGGER_US
+#define SERVO_STAGGER_US 460
+#endif
+
+/* timer 0 runs at F_CPU / 8; edges closer than SERVO_MIN_GAP ticks are merged
+ * into one port write, since the interrupt could not set up the second one in
+ * time (see servo_build()) */
+#define SERVO_TICKS(us) ((us) * (F_CPU / 1000ul) / 8000ul)
+#define SERVO_MIN_GAP 6
+#define SERVO_FRAME SERVO_TICKS(SERVO_FRAME_US)
+#define SERVO_SYNC SERVO_TICKS(SERVO_SYNC_US)
+#define SERVO_GROUP ((SERVO_FRAME - SERVO_SYNC) / SERVO_GROUPS)
+#define SERVO_STAGGER SERVO_TICKS(SERVO_STAGGER_US)
+#define SERVO_MIN SERVO_TICKS(SERVO_MIN_US)
+#define SERVO_MAX SERVO_TICKS(SERVO_MAX_US)
+
+#if (SERVO_SLOTS - 1) * SERVO_STAGGER + SERVO_MAX + SERVO_MIN_GAP > SERVO_GROUP
+#error the last pulse in a group would run into the next group
+#endif
+#if SERVO_SYNC <= SERVO_GROUP - SERVO_MIN
+#error the sync gap is too short to tell apart from the gaps between groups
+#endif
+
+#ifdef SERVO_STATS
+/* built in with SERVO_STATS (see the Makefile): worst cases since
+ * servo_stats_clear(), for working out how many channels a part can carry: the
+ * interrupt's latency from the compare match to the port write, in cycles plus
+ * a constant (so that the jitter is lat_max - lat_min); the cycles spent in it
+ * over the busiest frame, less its epilogue once per event, and that frame's
+ * events; the ticks it took to schedule a group; how many groups were played
+ * again because the next one was not scheduled in time; and how many edges came
+ * late because the interrupt was held off past them */
+struct servo_stats {
+	unsigned char lat_min, lat_max;
+	unsigned short frame_cycles;
+	unsigned char frame_events;
+	unsigned char build_ticks;
+	unsigned char late, slips;
+};
+extern volatile struct servo_stats servo_stats;
+
+void servo_stats_clear(void);
+#endif
+
+void servo_init(void);
+void servo_set(unsigned char channel, signed char value);
+void servo_poll(void);
+
+#endif
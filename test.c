@@ -1,30 +1,133 @@
+#include <avr/interrupt.h>
 #include <avr/io.h>
+#include <util/atomic.h>
+
+#include "servo.h"
+
+/* SPI commands, a byte each followed by their arguments:
+ * - SPI_NOP does nothing; a run of as many as the longest command gets back in
+ *   step after a lost byte, setting any channels it catches to the middle
+ * - SPI_SET <mask> <value>... sets the channels whose bits are set in a 24-bit
+ *   little-endian mask, to one signed value each, in channel order
+ * - SPI_STATS has the struct servo_stats clocked out by as many SPI_NOPs, after
+ *   a pause of a group (a few milliseconds) for the main loop to see it
+ * - SPI_CLEAR clears them
+ * the last two only with SERVO_STATS, and are SPI_NOPs without it
+ *
+ * the USI interrupt has to clear the overflow flag, which resets the bit
+ * counter too, before the next byte's first edge, or the bytes after it slip;
+ * it can be held off for all of the servo interrupt (about 60 cycles, 90 with
+ * SERVO_STATS) and then takes about 20 more to get there, so a master must
+ * leave at least 100 cycles (100 us at 1 MHz), or 150 with SERVO_STATS,
+ * between bytes, and clock them no faster than F_CPU / 16.  These are counted
+ * from the C, not measured.  Should a byte slip anyway, the main loop puts the
+ * counter back once a byte has stalled partway through for over a
+ * millisecond, so a pause that long and then a run of SPI_NOPs recover */
+#define SPI_NOP 0x00
+#define SPI_SET 0x01
+#define SPI_STATS 0x02
+#define SPI_CLEAR 0x03
+
+/* received bytes, from the USI overflow interrupt to the main loop, which may
+ * be busy scheduling a group for a few bytes' time */
+static volatile unsigned char rx[8], rx_head;
+static unsigned char rx_tail;
+
+#ifdef SERVO_STATS
+/* how much of servo_stats has been shifted out */
+static volatile unsigned char reply_pos = sizeof servo_stats;
+#endif
+
+ISR(USI_OVF_vect)
+{
+	unsigned char c = USIBR;
+	USISR = 1 << USIOIF;  /* weirdly enough, this clears the flag */
+#ifdef SERVO_STATS
+	USIDR = reply_pos < sizeof servo_stats ?
+		((volatile unsigned char *)&servo_stats)[reply_pos++] : 0;
+#endif
+	if ((unsigned char)(rx_head - rx_tail) < sizeof rx)
+		rx[rx_head++ % sizeof rx] = c;
+}
+
+/* reset the USI's bit counter (the low nibble of USISR) if it has stood
+ * partway through a byte for over a millisecond, timed on the servo timer */
+static void spi_resync(void)
+{
+	static unsigned char count, since;
+	unsigned char c = USISR & 0x0f;
+	if (!c || c != count) {
+		count = c;
+		since = TCNT0;
+	} else if ((unsigned char)(TCNT0 - since) > SERVO_TICKS(1000)) {
+		USISR = 0;
+		count = 0;
+	}
+}
+
+#ifdef SERVO_STATS
+static void spi_stats(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		USIDR = *(volatile unsigned char *)&servo_stats;
+		reply_pos = 1;
+	}
+}
+#endif
+
+/* the next channel set in mask from channel on */
+static unsigned char spi_next(const unsigned char *mask, unsigned char channel)
+{
+	while (channel < SERVO_CHANNELS && !(mask[channel / 8] & 1 << channel % 8))
+		++channel;
+	return channel;
+}
+
+static void spi_receive(unsigned char c)
+{
+	static unsigned char state, channel, mask[3];
+	switch (state) {
+	case 0:  /* a command */
+		if (c == SPI_SET)
+			state = 1;
+#ifdef SERVO_STATS
+		else if (c == SPI_STATS)
+			spi_stats();
+		else if (c == SPI_CLEAR)
+			servo_stats_clear();
+#endif
+		break;
+	case 1:  /* the mask */
+	case 2:
+	case 3:
+		mask[state++ - 1] = c;
+		if (state == 4 && (channel = spi_next(mask, 0)) == SERVO_CHANNELS)
+			state = 0;
+		break;
+	default:  /* a value */
+		servo_set(channel, c);
+		if ((channel = spi_next(mask, channel + 1)) == SERVO_CHANNELS)
+			state = 0;
+	}
+}
 
 int main(void)
 {
 	/* IO port setup */
-	DDRB = 1 << DDB4 | 1 << DDB1;  /* configure PB4 and PB1 for output */
+	DDRB = 1 << DDB1;  /* configure DO for output */
 
-	/* PWM timer setup */
-	GTCCR = 1 << PWM1B | 1 << COM1B1;  /* PWM generation on, output ORC1B */
-	OCR1B = 12;  /* 1.536-ms pulse width */
-	OCR1C = 155;  /* 19.968-ms period */
-	TCCR1 = 1 << CS13;  /* start the timer at F_CPU / 128 */
+	/* servo setup (see servo.h for the slot lines) */
+	servo_init();
 
 	/* SPI setup */
-	USICR = 1 << USIWM0 | 1 << USICS1;  /* SPI three-wire mode, slave */
+	USICR = 1 << USIOIE | 1 << USIWM0 | 1 << USICS1;  /* three-wire, slave */
+	sei();
 
-	char speed = 0;
 	while (1) {
-		USIDR = speed;
-		USISR = 1 << USIOIF;  /* weirdly enough, this clears the flag */
-		while (!(USISR & 1 << USIOIF));
-		speed = USIDR;
-		if (speed > 4)
-			speed = 4;
-		else if (speed < -4)
-			speed = -4;
-		OCR1B = 12 - speed;
+		servo_poll();
+		spi_resync();
+		if (rx_tail != rx_head)
+			spi_receive(rx[rx_tail++ % sizeof rx]);
 	}
 	return 0;
 }